@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "headers.h"
 #include "base.h"
 #include "ether.h"
@@ -5,39 +7,498 @@
 
 #include <sys/types.h>
 #include <ifaddrs.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 
 ustack_t *instance;
 
 iface_info_t *fd_to_iface(int fd)
 {
-	iface_info_t *iface = NULL;
-	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (iface->fd == fd)
-			return iface;
-	}
+	if (fd >= 0 && fd <= instance->max_fd && instance->fd_ifaces[fd])
+		return instance->fd_ifaces[fd];
 
 	log(ERROR, "Could not find the desired interface according to fd %d", fd);
 
 	return NULL;
 }
 
+iface_info_t *index_to_iface(int index)
+{
+	if (index >= 0 && index <= instance->max_index && instance->index_ifaces[index])
+		return instance->index_ifaces[index];
+
+	log(ERROR, "Could not find the desired interface according to ifindex %d", index);
+
+	return NULL;
+}
+
+// TPACKET_V3 rings shared with the kernel (see packet_mmap.rst in the kernel
+// documentation): received frames are written by the kernel into the blocks
+// of the rx ring, which are handed to user space as a whole; frames to send
+// are written into the slots of the tx ring, and sent by the kernel when the
+// socket is kicked with an empty send().
+#define RX_BLOCK_SIZE		(1 << 16)
+#define RX_BLOCK_NR			32
+#define RX_FRAME_SIZE		2048
+#define RX_BLOCK_TIMEOUT	1			// ms before a partially filled block is retired
+#define TX_FRAME_SIZE		2048
+#define TX_FRAME_NR			256
+#define TX_BLOCK_SIZE		(1 << 16)
+#define TX_BLOCK_NR			(TX_FRAME_NR * TX_FRAME_SIZE / TX_BLOCK_SIZE)
+
+// offset of the frame data in a tx slot
+#define TX_DATA_OFFSET		TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct packet_ring {
+	char *map;					// rx blocks, followed by tx slots
+	size_t map_size;
+
+	char *rx;
+	int rx_block;				// the next rx block to be read
+
+	char *tx;
+	int tx_frame;				// the next tx slot to be written
+	int tx_pending;				// number of frames not kicked yet
+	pthread_mutex_t tx_lock;	// tx slots can be written by any thread
+};
+
+// frames sent by the thread in iface_recv_packets are kicked (or queued, if
+// the interface has no packet ring) in one batch after all received frames are
+// handled
+static __thread int tx_deferred;
+
+// without the packet ring, frames are received by one recvmmsg() into the
+// buffers of rx_batch, and the frames sent meanwhile are copied into tx_batch,
+// to be sent by one sendmmsg() for all interfaces. A frame flooded to several
+// interfaces is copied only once.
+struct rx_batch {
+	struct mmsghdr msgs[USTACK_RX_BATCH];
+	struct iovec iovs[USTACK_RX_BATCH];
+	struct sockaddr_ll addrs[USTACK_RX_BATCH];
+	char bufs[USTACK_RX_BATCH][ETH_FRAME_LEN];
+};
+
+struct tx_batch {
+	int n;
+	iface_info_t *ifaces[USTACK_TX_BATCH];
+	struct iovec iovs[USTACK_TX_BATCH];
+	int nbufs;
+	char bufs[USTACK_TX_BATCH][ETH_FRAME_LEN];
+};
+
+static __thread struct rx_batch rx_batch;
+static __thread struct tx_batch tx_batch;
+
+#ifdef USTACK_PACKET_MMAP
+static int setup_packet_ring(iface_info_t *iface)
+{
+	int fd = iface->fd;
+	int version = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt() PACKET_VERSION failed");
+		return -1;
+	}
+
+	struct tpacket_req3 req;
+	bzero(&req, sizeof(req));
+	req.tp_block_size = RX_BLOCK_SIZE;
+	req.tp_block_nr = RX_BLOCK_NR;
+	req.tp_frame_size = RX_FRAME_SIZE;
+	req.tp_frame_nr = RX_BLOCK_SIZE / RX_FRAME_SIZE * RX_BLOCK_NR;
+	req.tp_retire_blk_tov = RX_BLOCK_TIMEOUT;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt() PACKET_RX_RING failed");
+		return -1;
+	}
+
+	bzero(&req, sizeof(req));
+	req.tp_block_size = TX_BLOCK_SIZE;
+	req.tp_block_nr = TX_BLOCK_NR;
+	req.tp_frame_size = TX_FRAME_SIZE;
+	req.tp_frame_nr = TX_FRAME_NR;
+	if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt() PACKET_TX_RING failed");
+		return -1;
+	}
+
+	struct packet_ring *ring = malloc(sizeof(struct packet_ring));
+	bzero(ring, sizeof(struct packet_ring));
+	ring->map_size = RX_BLOCK_SIZE * RX_BLOCK_NR + TX_BLOCK_SIZE * TX_BLOCK_NR;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (ring->map == MAP_FAILED) {
+		// MAP_LOCKED may exceed RLIMIT_MEMLOCK, try again without it
+		ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, \
+				MAP_SHARED, fd, 0);
+	}
+	if (ring->map == MAP_FAILED) {
+		perror("mmap() packet ring failed");
+		free(ring);
+		return -1;
+	}
+	ring->rx = ring->map;
+	ring->tx = ring->map + RX_BLOCK_SIZE * RX_BLOCK_NR;
+	pthread_mutex_init(&ring->tx_lock, NULL);
+
+	iface->ring = ring;
+
+	return 0;
+}
+#endif
+
+// kick the kernel to send the frames written into the tx ring
+static void kick_packet_ring(iface_info_t *iface)
+{
+	struct packet_ring *ring = iface->ring;
+	if (__atomic_exchange_n(&ring->tx_pending, 0, __ATOMIC_ACQ_REL) == 0)
+		return;
+
+	if (send(iface->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		perror("Kick packet ring failed");
+}
+
+// write the frame into the next slot of the tx ring, return -1 if the ring is
+// full
+static int ring_send_packet(iface_info_t *iface, const char *packet, int len)
+{
+	struct packet_ring *ring = iface->ring;
+
+	pthread_mutex_lock(&ring->tx_lock);
+
+	struct tpacket3_hdr *hdr = \
+		(struct tpacket3_hdr *)(ring->tx + ring->tx_frame * TX_FRAME_SIZE);
+	u32 status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+		pthread_mutex_unlock(&ring->tx_lock);
+		return -1;
+	}
+
+	memcpy((char *)hdr + TX_DATA_OFFSET, packet, len);
+	hdr->tp_len = len;
+	hdr->tp_snaplen = len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	ring->tx_frame = (ring->tx_frame + 1) % TX_FRAME_NR;
+	__atomic_add_fetch(&ring->tx_pending, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&ring->tx_lock);
+
+	if (!tx_deferred)
+		kick_packet_ring(iface);
+
+	return 0;
+}
+
+// hand a received frame to handle_packet, which takes the ownership of the
+// copied packet
+static void deliver_packet(iface_info_t *iface, const char *frame, int len)
+{
+	char *packet = malloc(len);
+	if (!packet) {
+		log(ERROR, "malloc failed when receiving packet.");
+		return;
+	}
+	memcpy(packet, frame, len);
+	handle_packet(iface, packet, len);
+}
+
+// handle the frames in the rx blocks retired by the kernel, until no block is
+// left or budget frames are received, return the number of handled frames
+static int ring_recv_packets(iface_info_t *iface, int budget)
+{
+	struct packet_ring *ring = iface->ring;
+	int n = 0, received = 0;
+
+	while (received < budget) {
+		struct tpacket_block_desc *block = \
+			(struct tpacket_block_desc *)(ring->rx + ring->rx_block * RX_BLOCK_SIZE);
+		if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		struct tpacket3_hdr *hdr = \
+			(struct tpacket3_hdr *)((char *)block + block->hdr.bh1.offset_to_first_pkt);
+		for (int i = 0; i < block->hdr.bh1.num_pkts; i++) {
+			struct sockaddr_ll *addr = \
+				(struct sockaddr_ll *)((char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			// XXX: Linux raw socket will capture both incoming and outgoing
+			// packets, while we only care about the incoming ones.
+			if (addr->sll_pkttype != PACKET_OUTGOING) {
+				int len = hdr->tp_snaplen < ETH_FRAME_LEN ? hdr->tp_snaplen : ETH_FRAME_LEN;
+				deliver_packet(iface, (char *)hdr + hdr->tp_mac, len);
+				n += 1;
+			}
+			hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+		}
+		received += block->hdr.bh1.num_pkts;
+
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ring->rx_block = (ring->rx_block + 1) % RX_BLOCK_NR;
+	}
+
+	return n;
+}
+
+// receive frames by recvmmsg() in batches and hand them to handle_packet,
+// until no frame is pending or budget frames are received, return the number
+// of handled frames
+static int batch_recv_packets(iface_info_t *iface, int budget)
+{
+	struct rx_batch *batch = &rx_batch;
+	int n = 0, received = 0;
+
+	while (received < budget) {
+		for (int i = 0; i < USTACK_RX_BATCH; i++) {
+			batch->iovs[i].iov_base = batch->bufs[i];
+			batch->iovs[i].iov_len = ETH_FRAME_LEN;
+
+			struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+			memset(hdr, 0, sizeof(struct msghdr));
+			hdr->msg_name = &batch->addrs[i];
+			hdr->msg_namelen = sizeof(struct sockaddr_ll);
+			hdr->msg_iov = &batch->iovs[i];
+			hdr->msg_iovlen = 1;
+		}
+
+		int cnt = recvmmsg(iface->fd, batch->msgs, USTACK_RX_BATCH, MSG_DONTWAIT, NULL);
+		if (cnt < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log(ERROR, "receive packet error: %s", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < cnt; i++) {
+			// XXX: Linux raw socket will capture both incoming and outgoing
+			// packets, while we only care about the incoming ones.
+			if (batch->addrs[i].sll_pkttype == PACKET_OUTGOING || \
+					batch->msgs[i].msg_len == 0)
+				continue;
+
+			deliver_packet(iface, batch->bufs[i], batch->msgs[i].msg_len);
+			n += 1;
+		}
+		received += cnt;
+
+		// the socket is drained
+		if (cnt < USTACK_RX_BATCH)
+			break;
+	}
+
+	return n;
+}
+
+// send the frames queued in tx_batch by one sendmmsg(): each message carries
+// the prebuilt address of its interface, so one socket sends them all
+static void flush_tx_batch()
+{
+	struct tx_batch *batch = &tx_batch;
+	struct mmsghdr msgs[USTACK_TX_BATCH];
+
+	for (int i = 0; i < batch->n; i++) {
+		struct msghdr *hdr = &msgs[i].msg_hdr;
+		memset(hdr, 0, sizeof(struct msghdr));
+		hdr->msg_name = &batch->ifaces[i]->addr;
+		hdr->msg_namelen = sizeof(struct sockaddr_ll);
+		hdr->msg_iov = &batch->iovs[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	int fd = batch->ifaces[0]->fd;
+	int sent = 0;
+	while (sent < batch->n) {
+		int ret = sendmmsg(fd, msgs + sent, batch->n - sent, 0);
+		if (ret < 0) {
+			// the first remaining frame failed, drop it and go on
+			perror("Send raw packet failed");
+			ret = 1;
+		}
+		sent += ret;
+	}
+
+	batch->n = 0;
+	batch->nbufs = 0;
+}
+
+// copy the frame into tx_batch once, and queue it to be sent out of the n
+// interfaces, n should not be larger than USTACK_TX_BATCH
+static void queue_packet(iface_info_t **ifaces, int n, const char *packet, int len)
+{
+	struct tx_batch *batch = &tx_batch;
+	if (batch->n + n > USTACK_TX_BATCH || batch->nbufs == USTACK_TX_BATCH)
+		flush_tx_batch();
+
+	char *buf = batch->bufs[batch->nbufs++];
+	memcpy(buf, packet, len);
+	for (int i = 0; i < n; i++) {
+		batch->ifaces[batch->n] = ifaces[i];
+		batch->iovs[batch->n].iov_base = buf;
+		batch->iovs[batch->n].iov_len = len;
+		batch->n += 1;
+	}
+}
+
+// kick the tx rings and send the queued frames, after tx_deferred is cleared
+static void flush_deferred_packets()
+{
+	for (int i = 0; i < instance->nifs; i++) {
+		if (instance->ifaces[i].ring)
+			kick_packet_ring(&instance->ifaces[i]);
+	}
+	if (tx_batch.n > 0)
+		flush_tx_batch();
+}
+
+// receive the frames pending on iface (at most about budget ones) and hand
+// them to handle_packet, return the number of handled frames
+//
+// The frames are read from the retired blocks of the packet ring, or received
+// by recvmmsg() in batches. The frames sent meanwhile are kicked or flushed
+// together afterwards.
+int iface_recv_packets(iface_info_t *iface, int budget)
+{
+	tx_deferred = 1;
+	int n = iface->ring ? ring_recv_packets(iface, budget) : \
+		batch_recv_packets(iface, budget);
+	tx_deferred = 0;
+
+	flush_deferred_packets();
+
+	return n;
+}
+
 void iface_send_packet(iface_info_t *iface, const char *packet, int len)
 {
-	struct sockaddr_ll addr;
-	memset(&addr, 0, sizeof(struct sockaddr_ll));
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = iface->index;
-	addr.sll_halen = ETH_ALEN;
-	addr.sll_protocol = htons(ETH_P_ARP);
-	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
+	if (iface->ring) {
+		if (ring_send_packet(iface, packet, len) == 0) {
+			return;
+		}
+		// the tx ring is full, send it directly
+		kick_packet_ring(iface);
+	}
+	else if (tx_deferred) {
+		queue_packet(&iface, 1, packet, len);
+		return;
+	}
 
-	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
+	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&iface->addr,
 				sizeof(struct sockaddr_ll)) < 0) {
 		perror("Send raw packet failed");
 	}
 }
 
+// send the frame out of every interface but iface
+//
+// The frame is written into the tx ring of each interface, or queued in
+// tx_batch for all the interfaces at once, so that it is sent by one
+// sendmmsg() along with the other deferred frames.
+void iface_flood_packet(iface_info_t *iface, const char *packet, int len)
+{
+	iface_info_t *ports[USTACK_TX_BATCH];
+	int n = 0;
+
+	int deferred = tx_deferred;
+	tx_deferred = 1;
+
+	for (int i = 0; i < instance->nifs; i++) {
+		iface_info_t *pos = &instance->ifaces[i];
+		if (pos == iface)
+			continue;
+
+		if (pos->ring) {
+			iface_send_packet(pos, packet, len);
+			continue;
+		}
+
+		ports[n++] = pos;
+		if (n == USTACK_TX_BATCH) {
+			queue_packet(ports, n, packet, len);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		queue_packet(ports, n, packet, len);
+
+	tx_deferred = deferred;
+	if (!tx_deferred)
+		flush_deferred_packets();
+}
+
+// periodic timers run by ustack_run, each one is a timerfd waited by epoll
+typedef struct {
+	int fd;
+	ustack_timer_handler func;
+	void *arg;
+} ustack_timer_t;
+
+static ustack_timer_t timers[USTACK_MAX_TIMERS];
+static int ntimers;
+
+// the epoll event of an interface carries its index in instance->ifaces, and
+// that of a timer carries its index in timers tagged with TIMER_EVENT
+#define TIMER_EVENT		(1ULL << 32)
+
+// call func(arg) every interval_ms milliseconds in ustack_run
+int ustack_add_timer(int interval_ms, ustack_timer_handler func, void *arg)
+{
+	if (ntimers == USTACK_MAX_TIMERS) {
+		log(ERROR, "could not add more than %d timers.", USTACK_MAX_TIMERS);
+		return -1;
+	}
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("timerfd_create() failed");
+		return -1;
+	}
+
+	struct itimerspec its;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime() failed");
+		close(fd);
+		return -1;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = TIMER_EVENT | ntimers;
+	if (epoll_ctl(instance->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		close(fd);
+		return -1;
+	}
+
+	timers[ntimers].fd = fd;
+	timers[ntimers].func = func;
+	timers[ntimers].arg = arg;
+	ntimers += 1;
+
+	return 0;
+}
+
+// handle an event returned by epoll_wait: receive the frames pending on the
+// interface, or run the expired timer; return the number of handled frames
+int ustack_handle_event(struct epoll_event *ev)
+{
+	if (ev->data.u64 & TIMER_EVENT) {
+		ustack_timer_t *timer = &timers[ev->data.u64 & ~TIMER_EVENT];
+
+		// the number of expirations is of no interest, a timer which is late
+		// runs only once
+		u64 expirations;
+		if (read(timer->fd, &expirations, sizeof(expirations)) > 0)
+			timer->func(timer->arg);
+
+		return 0;
+	}
+
+	return iface_recv_packets(&instance->ifaces[ev->data.u64], USTACK_RX_BUDGET);
+}
+
 int open_device(const char *dname)
 {
 	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
@@ -91,6 +552,15 @@ int read_iface_info(iface_info_t *iface)
 
 	iface->fd = fd;
 
+#ifdef USTACK_PACKET_MMAP
+	if (fd >= 0 && setup_packet_ring(iface) < 0) {
+		log(ERROR, "packet ring is not available on %s, use recvmmsg/sendmmsg instead.", \
+				iface->name);
+		close(fd);
+		iface->fd = fd = open_device(iface->name);
+	}
+#endif
+
 	int s = socket(AF_INET, SOCK_DGRAM, 0);
 	struct ifreq ifr;
 	strcpy(ifr.ifr_name, iface->name);
@@ -98,6 +568,14 @@ int read_iface_info(iface_info_t *iface)
 	ioctl(s, SIOCGIFINDEX, &ifr);
 	iface->index = ifr.ifr_ifindex;
 
+	// frames are sent out of the interface by its ifindex, the link-layer
+	// address is taken from the frame itself
+	memset(&iface->addr, 0, sizeof(struct sockaddr_ll));
+	iface->addr.sll_family = AF_PACKET;
+	iface->addr.sll_ifindex = iface->index;
+	iface->addr.sll_halen = ETH_ALEN;
+	iface->addr.sll_protocol = htons(ETH_P_ARP);
+
 	ioctl(s, SIOCGIFHWADDR, &ifr);
 	memcpy(&iface->mac, ifr.ifr_hwaddr.sa_data, sizeof(iface->mac));
 
@@ -125,6 +603,12 @@ int read_iface_info(iface_info_t *iface)
 	return fd;
 }
 
+static int is_available_iface(struct ifaddrs *addr)
+{
+	return addr->ifa_addr && addr->ifa_addr->sa_family == AF_PACKET && \
+		strstr(addr->ifa_name, "-eth") != NULL;
+}
+
 static void find_available_ifaces()
 {
 	init_list_head(&instance->iface_list);
@@ -132,27 +616,33 @@ static void find_available_ifaces()
 	struct ifaddrs *addrs,*addr;
 	getifaddrs(&addrs);
 	for (addr = addrs; addr != NULL; addr = addr->ifa_next) {
-		if (addr->ifa_addr && addr->ifa_addr->sa_family == AF_PACKET && \
-				strstr(addr->ifa_name, "-eth") != NULL) {
+		if (is_available_iface(addr))
+			instance->nifs += 1;
+	}
+
+	if (instance->nifs == 0) {
+		log(ERROR, "could not find available interfaces.");
+		exit(1);
+	}
 
-			iface_info_t *iface = malloc(sizeof(iface_info_t));
-			bzero(iface, sizeof(iface_info_t));
+	// the interfaces are stored in one array, and linked in iface_list in the
+	// same order
+	instance->ifaces = malloc(sizeof(iface_info_t) * instance->nifs);
+	bzero(instance->ifaces, sizeof(iface_info_t) * instance->nifs);
+
+	int i = 0;
+	for (addr = addrs; addr != NULL; addr = addr->ifa_next) {
+		if (is_available_iface(addr)) {
+			iface_info_t *iface = &instance->ifaces[i++];
 
 			init_list_head(&iface->list);
 			strcpy(iface->name, addr->ifa_name);
 
 			list_add_tail(&iface->list, &instance->iface_list);
-
-			instance->nifs += 1;
 		}
 	}
 	freeifaddrs(addrs);
 
-	if (instance->nifs == 0) {
-		log(ERROR, "could not find available interfaces.");
-		exit(1);
-	}
-
 	char dev_names[1024] = "";
 	iface_info_t *iface = NULL;
 	list_for_each_entry(iface, &instance->iface_list, list) {
@@ -165,17 +655,41 @@ void init_all_ifaces()
 {
 	find_available_ifaces();
 
-	instance->fds = malloc(sizeof(struct pollfd) * instance->nifs);
-	bzero(instance->fds, sizeof(struct pollfd) * instance->nifs);
+	instance->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (instance->epfd < 0) {
+		perror("epoll_create1() failed");
+		exit(1);
+	}
 
-	iface_info_t *iface = NULL;
-	int i = 0;
-	list_for_each_entry(iface, &instance->iface_list, list) {
+	for (int i = 0; i < instance->nifs; i++) {
+		iface_info_t *iface = &instance->ifaces[i];
 		int fd = read_iface_info(iface);
-		instance->fds[i].fd = fd;
-		instance->fds[i].events |= POLLIN;
 
-		i += 1;
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = i;
+		if (fd >= 0 && epoll_ctl(instance->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl() failed");
+			exit(1);
+		}
+
+		if (fd > instance->max_fd)
+			instance->max_fd = fd;
+		if (iface->index > instance->max_index)
+			instance->max_index = iface->index;
+	}
+
+	// fds and ifindexes are small integers, index the interfaces by them
+	instance->fd_ifaces = malloc(sizeof(iface_info_t *) * (instance->max_fd + 1));
+	bzero(instance->fd_ifaces, sizeof(iface_info_t *) * (instance->max_fd + 1));
+	instance->index_ifaces = malloc(sizeof(iface_info_t *) * (instance->max_index + 1));
+	bzero(instance->index_ifaces, sizeof(iface_info_t *) * (instance->max_index + 1));
+
+	for (int i = 0; i < instance->nifs; i++) {
+		iface_info_t *iface = &instance->ifaces[i];
+		if (iface->fd >= 0)
+			instance->fd_ifaces[iface->fd] = iface;
+		instance->index_ifaces[iface->index] = iface;
 	}
 }
 
@@ -6,14 +6,26 @@
 #include "list.h"
 
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <linux/if_packet.h>
 
-typedef struct {
-	struct list_head iface_list;
-	int nifs;
-	struct pollfd *fds;
-} ustack_t;
+// receive and send packets through the TPACKET_V3 rings shared with the
+// kernel, comment it out to use recvmmsg & sendmmsg instead
+#define USTACK_PACKET_MMAP
 
-extern ustack_t *instance;
+// without the packet rings, receive up to USTACK_RX_BATCH frames by one
+// recvmmsg(), and queue up to USTACK_TX_BATCH frames sent meanwhile to send
+// them by one sendmmsg() per interface; set both to 1 to handle one frame per
+// system call
+#define USTACK_RX_BATCH		32
+#define USTACK_TX_BATCH		64
+
+// ustack_run waits for the interfaces and timers by epoll, and drains each
+// ready interface until no frame is pending, or USTACK_RX_BUDGET frames are
+// received so that other interfaces are not starved
+#define USTACK_RX_BUDGET	256
+#define USTACK_MAX_EVENTS	64
+#define USTACK_MAX_TIMERS	8
 
 typedef struct {
 	struct list_head list;
@@ -22,11 +34,36 @@ typedef struct {
 	int index;
 	u8	mac[ETH_ALEN];
 	char name[16];
+
+	struct packet_ring *ring;
+	struct sockaddr_ll addr;
 } iface_info_t;
 
+typedef struct {
+	struct list_head iface_list;
+	int nifs;
+	iface_info_t *ifaces;
+	iface_info_t **fd_ifaces;
+	int max_fd;
+	iface_info_t **index_ifaces;
+	int max_index;
+	int epfd;
+} ustack_t;
+
+extern ustack_t *instance;
+
 void init_ustack();
 iface_info_t *fd_to_iface(int fd);
+iface_info_t *index_to_iface(int index);
+int iface_recv_packets(iface_info_t *iface, int budget);
 void iface_send_packet(iface_info_t *iface, const char *packet, int len);
+void iface_flood_packet(iface_info_t *iface, const char *packet, int len);
+
+typedef void (*ustack_timer_handler)(void *arg);
+int ustack_add_timer(int interval_ms, ustack_timer_handler func, void *arg);
+int ustack_handle_event(struct epoll_event *ev);
+
+void handle_packet(iface_info_t *iface, char *packet, int len);
 
 void broadcast_packet(iface_info_t *iface, const char *packet, int len);
 
@@ -1,19 +1,11 @@
 #include "base.h"
 #include <stdio.h>
 
-// XXX ifaces are stored in instace->iface_list
 extern ustack_t *instance;
 
-extern void iface_send_packet(iface_info_t *iface, const char *packet, int len);
-
 void broadcast_packet(iface_info_t *iface, const char *packet, int len)
 {
-	// TODO: broadcast packet 
-	iface_info_t *pos = NULL;
-
-	list_for_each_entry(pos, &instance->iface_list, list) {
-		if (pos != iface) {
-			iface_send_packet(pos, packet, len);
-		}
-	}
+	// instance saves all the interfaces in instance->ifaces
+	// the frame is sent out of all the other interfaces from the same buffer
+	iface_flood_packet(iface, packet, len);
 }
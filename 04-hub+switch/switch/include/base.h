@@ -10,6 +10,7 @@
 
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <ifaddrs.h>
 
 #include <netinet/in.h>
@@ -24,28 +25,77 @@
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
-typedef struct {
-	struct list_head iface_list;	// the list of interfaces
-	int nifs;						// number of interfaces
-	struct pollfd *fds;				// structure used to poll packets among 
-								    // all the interfaces
-} ustack_t;
+// receive and send packets through the TPACKET_V3 rings shared with the
+// kernel, comment it out to use recvmmsg & sendmmsg instead
+#define USTACK_PACKET_MMAP
 
-extern ustack_t *instance;
+// without the packet rings, receive up to USTACK_RX_BATCH frames by one
+// recvmmsg(), and queue up to USTACK_TX_BATCH frames sent meanwhile to send
+// them by one sendmmsg() per interface; set both to 1 to handle one frame per
+// system call
+#define USTACK_RX_BATCH		32
+#define USTACK_TX_BATCH		64
 
-typedef struct {
-	struct list_head list;		// list node used to link all interfaces
+// ustack_run waits for the interfaces and timers by epoll, and drains each
+// ready interface until no frame is pending, or USTACK_RX_BUDGET frames are
+// received so that other interfaces are not starved
+#define USTACK_RX_BUDGET	256
+#define USTACK_MAX_EVENTS	64
+#define USTACK_MAX_TIMERS	8
+
+// frames can be forwarded by up to USTACK_MAX_WORKERS threads, each one with
+// its own socket on every interface. The sockets of one interface are joined
+// into a PACKET_FANOUT_HASH group, so that the kernel spreads the received
+// frames among the workers, and the frames of one flow go to the same worker.
+#define USTACK_MAX_WORKERS	16
 
+// a socket bound to an interface, owned by one worker
+typedef struct {
 	int fd;						// file descriptor for receiving & sending 
 	                            // packets 
+	struct packet_ring *ring;	// rx & tx rings of fd, NULL if not mapped
+} iface_sock_t;
+
+typedef struct {
+	struct list_head list;		// list node used to link all interfaces
+
+	iface_sock_t socks[USTACK_MAX_WORKERS];	// sockets of each worker
 	int index;					// the index (unique ID) of this interface
 	u8	mac[ETH_ALEN];			// mac address of this interface
 	char name[16];				// name of this interface
+	struct sockaddr_ll addr;	// address to send frames out of this interface
 } iface_info_t;
 
+typedef struct {
+	struct list_head iface_list;	// the list of interfaces
+	int nifs;						// number of interfaces
+	iface_info_t *ifaces;			// all the interfaces in one array
+	iface_info_t **fd_ifaces;		// interfaces indexed by fd
+	int max_fd;
+	iface_info_t **index_ifaces;	// interfaces indexed by ifindex
+	int max_index;
+	int nworkers;					// number of forwarding threads
+	int epfds[USTACK_MAX_WORKERS];	// epoll instance of each worker, waiting
+									// for its sockets (and the timers, for
+									// the first worker)
+} ustack_t;
+
+extern ustack_t *instance;
+
 void init_ustack();
+void start_ustack_workers(int nworkers, void (*run)());
+int ustack_worker_id();
 iface_info_t *fd_to_iface(int fd);
+iface_info_t *index_to_iface(int index);
+int iface_recv_packets(iface_info_t *iface, int budget);
 void iface_send_packet(iface_info_t *iface, const char *packet, int len);
+void iface_flood_packet(iface_info_t *iface, const char *packet, int len);
+
+typedef void (*ustack_timer_handler)(void *arg);
+int ustack_add_timer(int interval_ms, ustack_timer_handler func, void *arg);
+int ustack_handle_event(struct epoll_event *ev);
+
+void handle_packet(iface_info_t *iface, char *packet, int len);
 
 void broadcast_packet(iface_info_t *iface, const char *packet, int len);
 
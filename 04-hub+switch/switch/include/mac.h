@@ -11,22 +11,61 @@
 
 #define MAC_PORT_TIMEOUT 30
 
+// entries are aged by a timing wheel: each entry is linked into the slot of the
+// second it would expire at if not visited again, and the sweeping thread
+// only checks the slot of the current second. Visiting an entry just updates
+// its visited time, the entry is moved to a later slot when its old slot is
+// checked. The number of slots should be larger than MAC_PORT_TIMEOUT.
+#define MAC_PORT_WHEEL_SLOTS	32
+
+// the mac_port table is split into MAC_PORT_SHARDS shards, each one guarded by
+// its own lock, so that forwarding threads learning or looking up different
+// mac addresses rarely contend on the same lock.
+#define MAC_PORT_SHARD_BITS		6
+#define MAC_PORT_SHARDS			(1 << MAC_PORT_SHARD_BITS)
+
+// each shard is a chained hash table which doubles when it holds more entries
+// than buckets, and halves when it is less than 1/8 full. Entries are moved to
+// the new buckets incrementally, MAC_PORT_REHASH_STEP buckets per update.
+#define MAC_PORT_MIN_BUCKETS	16
+#define MAC_PORT_REHASH_STEP	4
+
+#define CACHE_LINE_SIZE 64
+
 struct mac_port_entry {
 	struct list_head list;
-	uint8_t mac[ETH_ALEN];
+	struct list_head age_list;	// list node in the timing wheel
+	u8 mac[ETH_ALEN];
+	u32 hash;				// hash_mac(mac), kept for rehashing
 	iface_info_t *iface;
-	time_t visited;
+	time_t visited;			// refreshed atomically under the read lock
 };
 
 typedef struct mac_port_entry mac_port_entry_t;
 
+// one shard of the mac_port table, aligned to a cache line so that the locks
+// of adjacent shards never share one
+typedef struct {
+	pthread_rwlock_t lock;
+	int nentries;					// nentries, nbuckets and old_table are
+									// written atomically, as the sweeper
+									// peeks at them without the lock
+	struct list_head *hash_table;	// nbuckets buckets
+	int nbuckets;
+	struct list_head *old_table;	// buckets being rehashed, or NULL
+	int old_nbuckets;
+	int rehash_idx;					// old buckets below it are moved already
+	struct list_head wheel[MAC_PORT_WHEEL_SLOTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) mac_port_shard_t;
+
 typedef struct {
-	struct list_head hash_table[HASH_8BITS];
-	pthread_mutex_t lock;
+	mac_port_shard_t shards[MAC_PORT_SHARDS];
+	time_t now;					// coarse clock, updated by the sweeping thread
+	time_t swept;				// the last second whose wheel slot is checked
 	pthread_t thread;
 } mac_port_map_t;
 
-u8 hash_mac(u8 mac[ETH_ALEN]);
+u32 hash_mac(u8 mac[ETH_ALEN]);
 void *sweeping_mac_port_thread(void *);
 void init_mac_port_table();
 void destory_mac_port_table();
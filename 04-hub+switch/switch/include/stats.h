@@ -0,0 +1,95 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "base.h"
+#include "types.h"
+
+#include <stdio.h>
+
+// counters of the data plane
+//
+// Each thread counts into a block of its own, aligned to cache lines so that
+// no two threads write to the same line, without any lock or atomic
+// read-modify-write. The blocks are summed when the counters are read, by
+// dump_stats or through the unix socket started by start_stats_server.
+#define CACHE_LINE_SIZE 64
+
+// the counters are served at this abstract unix socket, which belongs to the
+// network namespace of the switch, e.g. read them in that namespace by
+// ``socat - ABSTRACT-CONNECT:switch.stats''. A connection may send one request
+// line instead: ``trace on'', ``trace off'' or ``trace'' to dump the trace
+// rings (see trace.h).
+#define STATS_SOCK_NAME		"switch.stats"
+
+// the counters are dumped if no request arrives in STATS_REQUEST_TIMEOUT ms
+#define STATS_REQUEST_TIMEOUT	100
+
+// only the first STATS_MAX_IFACES interfaces are counted
+#define STATS_MAX_IFACES	16
+
+enum stats_counter {
+	STATS_FORWARD,			// frames forwarded to the learned port
+	STATS_FLOOD,			// frames flooded, as the port is not learned
+	STATS_LEARN,			// mac addresses learned
+	STATS_MOVE,				// mac addresses moved to another port
+	STATS_AGE,				// mac addresses aged out
+	STATS_NR_COUNTERS,
+};
+
+typedef struct {
+	u64 rx_frames;
+	u64 rx_bytes;
+	u64 tx_frames;
+	u64 tx_bytes;
+} stats_iface_t;
+
+typedef struct stats_block {
+	struct stats_block *next;	// the blocks of all the threads are linked
+	u64 counters[STATS_NR_COUNTERS];
+	stats_iface_t ifaces[STATS_MAX_IFACES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_block_t;
+
+extern __thread stats_block_t *stats_local;
+
+stats_block_t *stats_register();
+void dump_stats(FILE *fp);
+void start_stats_server();
+
+static inline stats_block_t *stats_block()
+{
+	return stats_local ? stats_local : stats_register();
+}
+
+// only this thread writes the counter, so a plain add is enough; the store is
+// relaxed atomic so that a reader never sees a torn value
+static inline void stats_add(u64 *counter, u64 n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(enum stats_counter counter)
+{
+	stats_add(&stats_block()->counters[counter], 1);
+}
+
+static inline void stats_iface_rx(iface_info_t *iface, int len)
+{
+	unsigned i = iface - instance->ifaces;
+	if (i < STATS_MAX_IFACES) {
+		stats_iface_t *stats = &stats_block()->ifaces[i];
+		stats_add(&stats->rx_frames, 1);
+		stats_add(&stats->rx_bytes, len);
+	}
+}
+
+static inline void stats_iface_tx(iface_info_t *iface, int len)
+{
+	unsigned i = iface - instance->ifaces;
+	if (i < STATS_MAX_IFACES) {
+		stats_iface_t *stats = &stats_block()->ifaces[i];
+		stats_add(&stats->tx_frames, 1);
+		stats_add(&stats->tx_bytes, len);
+	}
+}
+
+#endif
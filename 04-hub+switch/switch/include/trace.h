@@ -0,0 +1,75 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "base.h"
+#include "types.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// debug logs on the forwarding path are compiled in only by ``make
+// DEBUG_LOG=1''; otherwise they compile to nothing, while their arguments are
+// still type checked
+#ifdef USTACK_DEBUG_LOG
+#define log_debug(fmt, ...)	log(DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define log_debug(fmt, ...) \
+	do { \
+		if (0) \
+			log(DEBUG, fmt, ##__VA_ARGS__); \
+	} while (0)
+#endif
+
+// tracepoints on the forwarding path
+//
+// When tracing is enabled at run time (``trace on'' through the stats socket),
+// each tracepoint records an event with a timestamp into the trace ring of the
+// calling thread, whose oldest records are overwritten. When it is disabled, a
+// tracepoint costs one load and a branch; ``make NO_TRACE=1'' compiles them out.
+#define TRACE_RING_SIZE		4096		// records per thread, a power of 2
+
+enum trace_event {
+	TRACE_PACKET_IN,		// frame received, arg0: length
+	TRACE_LOOKUP,			// mac_port lookup, arg0: mac, iface: the port found
+	TRACE_SEND,				// frame sent, arg0: length
+};
+
+typedef struct {
+	u64 ns;					// CLOCK_MONOTONIC
+	int event;
+	int iface;				// index in instance->ifaces, -1 if none
+	u64 arg0;
+	u64 arg1;
+} trace_record_t;
+
+typedef struct trace_ring {
+	struct trace_ring *next;	// the rings of all the threads are linked
+	u64 head;					// number of records ever written
+	trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+extern int trace_enabled;
+
+static inline u64 trace_mac(u8 mac[ETH_ALEN])
+{
+	u64 value = 0;
+	memcpy(&value, mac, ETH_ALEN);
+	return value;
+}
+
+void trace_record(enum trace_event event, iface_info_t *iface, u64 arg0, u64 arg1);
+void set_trace_enabled(int enabled);
+void dump_trace(FILE *fp);
+
+#ifdef USTACK_NO_TRACE
+#define trace(event, iface, arg0, arg1)	do { } while (0)
+#else
+#define trace(event, iface, arg0, arg1) \
+	do { \
+		if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) \
+			trace_record(event, iface, arg0, arg1); \
+	} while (0)
+#endif
+
+#endif
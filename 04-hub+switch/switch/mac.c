@@ -1,4 +1,5 @@
 #include "mac.h"
+#include "stats.h"
 #include "log.h"
 
 #include <pthread.h>
@@ -7,10 +8,128 @@
 
 mac_port_map_t mac_port_map;
 
-u8 hash_mac(u8 mac[ETH_ALEN])
+// hash the 48-bit mac address with the 64-bit finalizer of murmur3, every bit
+// of the address affects every bit of the result, so both the shard (high
+// bits) and the bucket (low bits) are well distributed
+u32 hash_mac(u8 mac[ETH_ALEN])
 {
-	int hash =  mac[0] ^ (mac[1] << 1) ^ (mac[2] << 2) ^ (mac[3] << 3) ^ (mac[4] << 4) ^ (mac[5] << 5);
-	return hash & (HASH_8BITS - 1);
+	u64 key = 0;
+	memcpy(&key, mac, ETH_ALEN);
+
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return (u32)key;
+}
+
+static inline mac_port_shard_t *mac_to_shard(u32 hash)
+{
+	return &mac_port_map.shards[hash >> (32 - MAC_PORT_SHARD_BITS)];
+}
+
+// get the bucket where the entry with the given hash is (or would be) stored,
+// the lock of the shard should be held
+//
+// While the shard is being rehashed, the old buckets below rehash_idx have
+// been moved to the new table, the others are still in use.
+static inline struct list_head *mac_to_bucket(mac_port_shard_t *shard, u32 hash)
+{
+	if (shard->old_table) {
+		int idx = hash & (shard->old_nbuckets - 1);
+		if (idx >= shard->rehash_idx)
+			return &shard->old_table[idx];
+	}
+
+	return &shard->hash_table[hash & (shard->nbuckets - 1)];
+}
+
+static struct list_head *new_mac_port_buckets(int nbuckets)
+{
+	struct list_head *table = malloc(sizeof(struct list_head) * nbuckets);
+	if (!table) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < nbuckets; i++)
+		init_list_head(&table[i]);
+
+	return table;
+}
+
+// move at most n buckets of the old table into the new one, the write lock of
+// the shard should be held
+static void rehash_mac_port_shard(mac_port_shard_t *shard, int n)
+{
+	if (!shard->old_table)
+		return;
+
+	for (; n > 0 && shard->rehash_idx < shard->old_nbuckets; n--) {
+		mac_port_entry_t *pos, *q;
+		struct list_head *bucket = &shard->old_table[shard->rehash_idx];
+		list_for_each_entry_safe(pos, q, bucket, list) {
+			list_delete_entry(&pos->list);
+			list_add_head(&pos->list, \
+					&shard->hash_table[pos->hash & (shard->nbuckets - 1)]);
+		}
+		shard->rehash_idx += 1;
+	}
+
+	if (shard->rehash_idx == shard->old_nbuckets) {
+		free(shard->old_table);
+		__atomic_store_n(&shard->old_table, NULL, __ATOMIC_RELAXED);
+		shard->old_nbuckets = 0;
+		shard->rehash_idx = 0;
+	}
+}
+
+// start rehashing the shard into nbuckets buckets, unless a previous rehash is
+// still in progress. The write lock of the shard should be held.
+static void resize_mac_port_shard(mac_port_shard_t *shard, int nbuckets)
+{
+	if (shard->old_table || nbuckets == shard->nbuckets)
+		return;
+
+	__atomic_store_n(&shard->old_table, shard->hash_table, __ATOMIC_RELAXED);
+	shard->old_nbuckets = shard->nbuckets;
+	shard->rehash_idx = 0;
+
+	shard->hash_table = new_mac_port_buckets(nbuckets);
+	__atomic_store_n(&shard->nbuckets, nbuckets, __ATOMIC_RELAXED);
+}
+
+// the current time, read from the coarse clock instead of calling time()
+static inline time_t mac_port_now()
+{
+	return __atomic_load_n(&mac_port_map.now, __ATOMIC_RELAXED);
+}
+
+static inline struct list_head *mac_to_wheel_slot(mac_port_shard_t *shard, time_t expire)
+{
+	return &shard->wheel[expire & (MAC_PORT_WHEEL_SLOTS - 1)];
+}
+
+static void delete_mac_port_entry(mac_port_shard_t *shard, mac_port_entry_t *entry)
+{
+	list_delete_entry(&entry->list);
+	list_delete_entry(&entry->age_list);
+	free(entry);
+	__atomic_store_n(&shard->nentries, shard->nentries - 1, __ATOMIC_RELAXED);
+}
+
+// find the entry of mac in the bucket, the lock of the shard should be held
+static mac_port_entry_t *find_mac_port_entry(struct list_head *bucket, u8 mac[ETH_ALEN])
+{
+	mac_port_entry_t *pos = NULL;
+	list_for_each_entry(pos, bucket, list) {
+		if (memcmp(pos->mac, mac, ETH_ALEN) == 0)
+			return pos;
+	}
+
+	return NULL;
 }
 
 // initialize mac_port table
@@ -18,11 +137,17 @@ void init_mac_port_table()
 {
 	bzero(&mac_port_map, sizeof(mac_port_map_t));
 
-	for (int i = 0; i < HASH_8BITS; i++) {
-		init_list_head(&mac_port_map.hash_table[i]);
+	for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+		mac_port_shard_t *shard = &mac_port_map.shards[i];
+		shard->hash_table = new_mac_port_buckets(MAC_PORT_MIN_BUCKETS);
+		shard->nbuckets = MAC_PORT_MIN_BUCKETS;
+		for (int j = 0; j < MAC_PORT_WHEEL_SLOTS; j++)
+			init_list_head(&shard->wheel[j]);
+		pthread_rwlock_init(&shard->lock, NULL);
 	}
 
-	pthread_mutex_init(&mac_port_map.lock, NULL);
+	mac_port_map.now = time(NULL);
+	mac_port_map.swept = mac_port_map.now;
 
 	pthread_create(&mac_port_map.thread, NULL, sweeping_mac_port_thread, NULL);
 }
@@ -30,57 +155,71 @@ void init_mac_port_table()
 // destroy mac_port table
 void destory_mac_port_table()
 {
-	pthread_mutex_lock(&mac_port_map.lock);
 	mac_port_entry_t *entry, *q;
-	for (int i = 0; i < HASH_8BITS; i++) {
-		list_for_each_entry_safe(entry, q, &mac_port_map.hash_table[i], list) {
-			list_delete_entry(&entry->list);
-			free(entry);
+	for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+		mac_port_shard_t *shard = &mac_port_map.shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		rehash_mac_port_shard(shard, shard->old_nbuckets);
+		for (int j = 0; j < shard->nbuckets; j++) {
+			list_for_each_entry_safe(entry, q, &shard->hash_table[j], list)
+				delete_mac_port_entry(shard, entry);
 		}
+		pthread_rwlock_unlock(&shard->lock);
 	}
-	pthread_mutex_unlock(&mac_port_map.lock);
 }
 
 // lookup the mac address in mac_port table
 iface_info_t *lookup_port(u8 mac[ETH_ALEN])
 {
-	// TODO: implement the lookup process here
-	// fprintf(stdout, "TODO: implement the lookup process here.\n");
+	u32 hash = hash_mac(mac);
+	mac_port_shard_t *shard = mac_to_shard(hash);
+	iface_info_t *iface = NULL;
 
-	u8 hash = hash_mac(mac);
-	mac_port_entry_t *pos = NULL;
+	pthread_rwlock_rdlock(&shard->lock);
 
-	pthread_mutex_lock(&mac_port_map.lock);
+	mac_port_entry_t *entry = find_mac_port_entry(mac_to_bucket(shard, hash), mac);
+	if (entry)
+		iface = entry->iface;
 
-	list_for_each_entry(pos, &mac_port_map.hash_table[hash], list) {
-		if (memcmp(pos->mac, mac, ETH_ALEN) == 0) {
-			pthread_mutex_unlock(&mac_port_map.lock);
-			return pos->iface;
-		}
-	}
+	pthread_rwlock_unlock(&shard->lock);
 
-	pthread_mutex_unlock(&mac_port_map.lock);
-	return NULL;
+	return iface;
 }
 
 // insert the mac -> iface mapping into mac_port table
+//
+// In the common case the mapping is already learned, only its visited time is
+// refreshed under the read lock; the write lock is taken only when a new mac
+// address is learned or a host moves to another port.
 void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
 {
-	// TODO: implement the insertion process here
-	// fprintf(stdout, "TODO: implement the insertion process here.\n");
+	u32 hash = hash_mac(mac);
+	mac_port_shard_t *shard = mac_to_shard(hash);
+	time_t now = mac_port_now();
 
-	u8 hash = hash_mac(mac);
+	pthread_rwlock_rdlock(&shard->lock);
+	mac_port_entry_t *entry = find_mac_port_entry(mac_to_bucket(shard, hash), mac);
+	if (entry && entry->iface == iface) {
+		if (__atomic_load_n(&entry->visited, __ATOMIC_RELAXED) != now)
+			__atomic_store_n(&entry->visited, now, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&shard->lock);
+		return;
+	}
+	pthread_rwlock_unlock(&shard->lock);
 
-	pthread_mutex_lock(&mac_port_map.lock);
+	pthread_rwlock_wrlock(&shard->lock);
 
-	mac_port_entry_t *pos = NULL;
-	list_for_each_entry(pos, &mac_port_map.hash_table[hash], list) {
-		if (memcmp(pos->mac, mac, ETH_ALEN) == 0) {
-			pos->iface = iface;
-			pos->visited = time(NULL);
-			pthread_mutex_unlock(&mac_port_map.lock);
-			return;
-		}
+	rehash_mac_port_shard(shard, MAC_PORT_REHASH_STEP);
+
+	// the entry may have been learned by another thread in the meantime
+	entry = find_mac_port_entry(mac_to_bucket(shard, hash), mac);
+	if (entry) {
+		if (entry->iface != iface)
+			stats_inc(STATS_MOVE);
+		entry->iface = iface;
+		entry->visited = now;
+		pthread_rwlock_unlock(&shard->lock);
+		return;
 	}
 
 	mac_port_entry_t *new_entry = malloc(sizeof(mac_port_entry_t));
@@ -89,57 +228,121 @@ void insert_mac_port(u8 mac[ETH_ALEN], iface_info_t *iface)
 		exit(EXIT_FAILURE);
 	}
 	memcpy(new_entry->mac, mac, ETH_ALEN);
+	new_entry->hash = hash;
 	new_entry->iface = iface;
-	new_entry->visited = time(NULL);
-	list_add_head(&new_entry->list, &mac_port_map.hash_table[hash]);
-	pthread_mutex_unlock(&mac_port_map.lock);
+	new_entry->visited = now;
+	list_add_head(&new_entry->list, mac_to_bucket(shard, hash));
+	list_add_tail(&new_entry->age_list, mac_to_wheel_slot(shard, now + MAC_PORT_TIMEOUT));
+	__atomic_store_n(&shard->nentries, shard->nentries + 1, __ATOMIC_RELAXED);
+	stats_inc(STATS_LEARN);
+
+	if (shard->nentries > shard->nbuckets)
+		resize_mac_port_shard(shard, shard->nbuckets * 2);
+
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+static void dump_mac_port_bucket(struct list_head *bucket, time_t now)
+{
+	mac_port_entry_t *entry = NULL;
+	list_for_each_entry(entry, bucket, list) {
+		fprintf(stdout, ETHER_STRING " -> %s, %d\n", ETHER_FMT(entry->mac), \
+				entry->iface->name, \
+				(int)(now - __atomic_load_n(&entry->visited, __ATOMIC_RELAXED)));
+	}
 }
 
 // dumping mac_port table
 void dump_mac_port_table()
 {
-	mac_port_entry_t *entry = NULL;
-	time_t now = time(NULL);
+	time_t now = mac_port_now();
 
 	fprintf(stdout, "dumping the mac_port table:\n");
-	pthread_mutex_lock(&mac_port_map.lock);
-	for (int i = 0; i < HASH_8BITS; i++) {
-		list_for_each_entry(entry, &mac_port_map.hash_table[i], list) {
-			fprintf(stdout, ETHER_STRING " -> %s, %d\n", ETHER_FMT(entry->mac), \
-					entry->iface->name, (int)(now - entry->visited));
+	for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+		mac_port_shard_t *shard = &mac_port_map.shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for (int j = shard->rehash_idx; shard->old_table && j < shard->old_nbuckets; j++)
+			dump_mac_port_bucket(&shard->old_table[j], now);
+		for (int j = 0; j < shard->nbuckets; j++)
+			dump_mac_port_bucket(&shard->hash_table[j], now);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+// check the wheel slot of the given second: remove the entries which have not
+// been visited in the last MAC_PORT_TIMEOUT seconds, and move the others to
+// the slot of their new expiration time. The write lock of the shard should be
+// held. Return the number of removed entries.
+static int sweep_mac_port_wheel_slot(mac_port_shard_t *shard, time_t slot, time_t now)
+{
+	mac_port_entry_t *pos, *q;
+	int removed_count = 0;
+
+	// entries moved back into this slot are added to its head, and will not
+	// be visited again in this iteration
+	list_for_each_entry_safe(pos, q, mac_to_wheel_slot(shard, slot), age_list) {
+		time_t expire = __atomic_load_n(&pos->visited, __ATOMIC_RELAXED) + MAC_PORT_TIMEOUT;
+		if (expire <= now) {
+			delete_mac_port_entry(shard, pos);
+			removed_count++;
+		}
+		else {
+			list_delete_entry(&pos->age_list);
+			list_add_head(&pos->age_list, mac_to_wheel_slot(shard, expire));
 		}
 	}
 
-	pthread_mutex_unlock(&mac_port_map.lock);
+	return removed_count;
 }
 
 // sweeping mac_port table, remove the entry which has not been visited in the
 // last 30 seconds.
+//
+// Only the wheel slots of the seconds passed since the last sweep are checked,
+// so the work is proportional to the number of entries due in these seconds
+// rather than the size of the table. Shards are swept one at a time, and a
+// shard which has become sparse is shrunk afterwards.
 int sweep_aged_mac_port_entry()
 {
-	// TODO: implement the sweeping process here
-	// fprintf(stdout, "TODO: implement the sweeping process here.\n");
-
 	time_t now = time(NULL);
 	int removed_count = 0;
-	pthread_mutex_lock(&mac_port_map.lock);
 
-	for (int hash = 0; hash < HASH_8BITS; hash++) {
-		mac_port_entry_t *pos, *q;
-		list_for_each_entry_safe(pos, q, &mac_port_map.hash_table[hash], list) {
-			if ((int)(now - pos->visited) >= MAC_PORT_TIMEOUT) {
-				list_delete_entry(&pos->list);
-				free(pos);
-				removed_count++;
-			}
-		}
+	__atomic_store_n(&mac_port_map.now, now, __ATOMIC_RELAXED);
+
+	time_t from = mac_port_map.swept + 1;
+	if (now - from >= MAC_PORT_WHEEL_SLOTS)
+		from = now - MAC_PORT_WHEEL_SLOTS + 1;
+	mac_port_map.swept = now;
+
+	for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+		mac_port_shard_t *shard = &mac_port_map.shards[i];
+		if (__atomic_load_n(&shard->nentries, __ATOMIC_RELAXED) == 0 && \
+				__atomic_load_n(&shard->nbuckets, __ATOMIC_RELAXED) == MAC_PORT_MIN_BUCKETS && \
+				!__atomic_load_n(&shard->old_table, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_rwlock_wrlock(&shard->lock);
+
+		for (time_t slot = from; slot <= now; slot++)
+			removed_count += sweep_mac_port_wheel_slot(shard, slot, now);
+
+		// the buckets of an empty shard are all empty, and its old table is
+		// freed at once rather than kept until the next insert
+		rehash_mac_port_shard(shard, shard->nentries ? MAC_PORT_REHASH_STEP : shard->old_nbuckets);
+		if (shard->nentries * 8 < shard->nbuckets && \
+				shard->nbuckets > MAC_PORT_MIN_BUCKETS)
+			resize_mac_port_shard(shard, shard->nbuckets / 2);
+
+		pthread_rwlock_unlock(&shard->lock);
 	}
 
-	pthread_mutex_unlock(&mac_port_map.lock);
+	stats_add(&stats_block()->counters[STATS_AGE], removed_count);
+
 	return removed_count;
 }
 
-// sweeping mac_port table periodically, by calling sweep_aged_mac_port_entry
+// sweeping mac_port table periodically, by calling sweep_aged_mac_port_entry,
+// which also ticks the coarse clock used by the forwarding path
 void *sweeping_mac_port_thread(void *nil)
 {
 	while (1) {
@@ -0,0 +1,217 @@
+// benchmark the lookups of the mac_port table, from 10 to 1M learned macs
+//
+// For each size, the table is filled with random mac addresses, and then
+// looked up for random learned ones. Besides the time per lookup, it reports
+// the mean number of entries compared by a lookup, which stays about the same
+// as the table grows, so that the growth of the time is not from longer chain
+// walks. To tell what it is from, it also reports:
+//
+//   hot:   the time per lookup when only 64 of the learned macs are looked
+//          up, which stay in the cache, however large the table is;
+//   chase: the latency of a load from a buffer as large as the table,
+//          measured by chasing pointers through it in a random order, which
+//          misses the cache once the buffer outgrows it.
+//
+// A lookup reads the lock of the shard, which stays in the cache as there are
+// only MAC_PORT_SHARDS of them, then the head of the bucket and the entry,
+// which are dependent loads. So once the table outgrows the cache a lookup
+// costs about two of these misses, while the hot lookups cost the same as in
+// a table of 10 macs.
+//
+// Build it by ``make macbench''.
+//
+// usage: ./macbench [-n lookups] [max entries]
+
+#include "base.h"
+#include "mac.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MACBENCH_HOT	64
+
+ustack_t *instance;
+
+extern mac_port_map_t mac_port_map;
+
+static u64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u64 rand_state = 88172645463325252ULL;
+
+static u64 rand64()
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+// the mean number of entries compared by the lookup of a learned mac: an entry
+// at position i of its chain is found after i + 1 comparisons
+static double mean_probes()
+{
+	u64 probes = 0, n = 0;
+	for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+		mac_port_shard_t *shard = &mac_port_map.shards[i];
+		for (int t = 0; t < 2; t++) {
+			struct list_head *table = t ? shard->old_table : shard->hash_table;
+			int from = t ? shard->rehash_idx : 0;
+			int to = t ? shard->old_nbuckets : shard->nbuckets;
+			for (int j = from; table && j < to; j++) {
+				int len = 0;
+				mac_port_entry_t *entry = NULL;
+				list_for_each_entry(entry, &table[j], list)
+					probes += ++len;
+				n += len;
+			}
+		}
+	}
+
+	return n ? (double)probes / n : 0;
+}
+
+// look up nlookups macs, taken in turn from the first nkeys of keys
+static double time_lookups(u8 (*keys)[ETH_ALEN], int nkeys, int nlookups)
+{
+	iface_info_t *miss = NULL;
+	u64 start = now_ns();
+	for (int i = 0, k = 0; i < nlookups; i++) {
+		if (!lookup_port(keys[k]))
+			miss = (iface_info_t *)1;
+		if (++k == nkeys)
+			k = 0;
+	}
+	u64 elapsed = now_ns() - start;
+
+	if (miss) {
+		fprintf(stderr, "a learned mac is not found.\n");
+		exit(1);
+	}
+
+	return (double)elapsed / nlookups;
+}
+
+// the latency of a load missing the cache: chase the pointers of a random
+// cycle through a buffer of size bytes, one pointer per cache line
+static double time_chase(size_t size, int nloads)
+{
+	size_t nlines = size / CACHE_LINE_SIZE;
+	if (nlines < 2)
+		nlines = 2;
+
+	char *buf = malloc(nlines * CACHE_LINE_SIZE);
+	size_t *order = malloc(sizeof(size_t) * nlines);
+	if (!buf || !order) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < nlines; i++)
+		order[i] = i;
+	for (size_t i = nlines - 1; i > 0; i--) {
+		size_t j = rand64() % (i + 1), t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (size_t i = 0; i < nlines; i++)
+		*(void **)(buf + order[i] * CACHE_LINE_SIZE) = \
+			buf + order[(i + 1) % nlines] * CACHE_LINE_SIZE;
+
+	void **p = (void **)(buf + order[0] * CACHE_LINE_SIZE);
+	u64 start = now_ns();
+	for (int i = 0; i < nloads; i++)
+		p = *p;
+	u64 elapsed = now_ns() - start;
+
+	// keep the chase from being optimized out
+	if (p == NULL)
+		printf("\n");
+
+	free(order);
+	free(buf);
+
+	return (double)elapsed / nloads;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n lookups] [max entries]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int nlookups = 2000000, max = 1000000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n': nlookups = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		max = atoi(argv[optind]);
+	if (nlookups <= 0 || max < 10)
+		usage(argv[0]);
+
+	u8 (*keys)[ETH_ALEN] = malloc(sizeof(*keys) * max);
+	if (!keys) {
+		perror("malloc");
+		exit(1);
+	}
+
+	iface_info_t iface;
+	bzero(&iface, sizeof(iface));
+	strcpy(iface.name, "bench-eth0");
+
+	printf("%10s %10s %10s %10s %10s %10s\n", "entries", "buckets", "probes", \
+			"ns/lookup", "hot ns", "chase ns");
+
+	for (int n = 10; n <= max; n *= 10) {
+		init_mac_port_table();
+
+		for (int i = 0; i < n; i++) {
+			u64 r = rand64();
+			memcpy(keys[i], &r, ETH_ALEN);
+			keys[i][0] &= 0xfe;		// unicast
+			insert_mac_port(keys[i], &iface);
+		}
+
+		int nbuckets = 0;
+		for (int i = 0; i < MAC_PORT_SHARDS; i++)
+			nbuckets += mac_port_map.shards[i].nbuckets;
+
+		// the lookups are in the order of insertion, which is random
+		double cold = time_lookups(keys, n, nlookups);
+		double hot = time_lookups(keys, n < MACBENCH_HOT ? n : MACBENCH_HOT, nlookups);
+
+		// the memory of the table: the entries (allocated in 64 bytes each),
+		// and the buckets
+		size_t size = (size_t)n * 64 + (size_t)nbuckets * sizeof(struct list_head);
+		double chase = time_chase(size, nlookups);
+
+		printf("%10d %10d %10.2f %10.1f %10.1f %10.1f\n", n, nbuckets, \
+				mean_probes(), cold, hot, chase);
+
+		pthread_cancel(mac_port_map.thread);
+		pthread_join(mac_port_map.thread, NULL);
+		destory_mac_port_table();
+		for (int i = 0; i < MAC_PORT_SHARDS; i++) {
+			free(mac_port_map.shards[i].hash_table);
+			pthread_rwlock_destroy(&mac_port_map.shards[i].lock);
+		}
+	}
+
+	free(keys);
+
+	return 0;
+}
@@ -1,6 +1,9 @@
 #include "base.h"
 #include "ether.h"
 #include "mac.h"
+#include "packet.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #include "log.h"
@@ -15,80 +18,54 @@
 // 2. put the src mac -> iface mapping into mac hash table.
 // 3. release the memory of ``packet''
 
-// Note: the log & fprintf here are only used for debug, which should be commented 
-// out for better performance.
+// Note: the debug logs here are compiled in only by ``make DEBUG_LOG=1''.
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
 	// TODO: implement the packet forwarding process here
 	// fprintf(stdout, "TODO: implement the packet forwarding process here.\n");
 
 	struct ether_header *eh = (struct ether_header *)packet;
-	// log(DEBUG, "the dst mac address is " ETHER_STRING ".\n", ETHER_FMT(eh->ether_dhost));
+	log_debug("the dst mac address is " ETHER_STRING ".", ETHER_FMT(eh->ether_dhost));
+
+	stats_iface_rx(iface, len);
+	trace(TRACE_PACKET_IN, iface, len, 0);
 
 	iface_info_t *dst_iface = lookup_port(eh->ether_dhost);
+	trace(TRACE_LOOKUP, dst_iface, trace_mac(eh->ether_dhost), 0);
 
 	if (dst_iface) {
-		// log(DEBUG, "found the dest iface %s in mac_port table, forward the packet.\n", dst_iface->name);
+		log_debug("found the dest iface %s in mac_port table, forward the packet.", dst_iface->name);
 		iface_send_packet(dst_iface, packet, len);
+		stats_inc(STATS_FORWARD);
 	}
 	else {
-		// log(DEBUG, "did not find the dest iface in mac_port table, broadcast the packet.\n");
+		log_debug("did not find the dest iface in mac_port table, broadcast the packet.");
 		broadcast_packet(iface, packet, len);
+		stats_inc(STATS_FLOOD);
 	}
 
 	insert_mac_port(eh->ether_shost, iface);
-	// log(DEBUG, "insert the src mac address " ETHER_STRING " into mac_port table.\n", ETHER_FMT(eh->ether_shost));
+	log_debug("insert the src mac address " ETHER_STRING " into mac_port table.", ETHER_FMT(eh->ether_shost));
 	
-	free(packet);
+	packet_free(packet);
 }
 
 // run user stack, receive packet on each interface, and handle those packet
-// like normal switch
+// like normal switch; each worker waits for its own sockets
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	struct epoll_event events[USTACK_MAX_EVENTS];
+	int epfd = instance->epfds[ustack_worker_id()];
 
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = epoll_wait(epfd, events, USTACK_MAX_EVENTS, -1);
 		if (ready < 0) {
 			perror("Poll failed!");
 			break;
 		}
-		else if (ready == 0)
-			continue;
-
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, while we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					if (!iface) 
-						continue;
-
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
-			}
-		}
+
+		for (int i = 0; i < ready; i++)
+			ustack_handle_event(&events[i]);
 	}
 }
 
@@ -103,6 +80,12 @@ int main(int argc, const char **argv)
 
 	init_mac_port_table();
 
+	start_stats_server();
+
+	// the number of forwarding threads can be given as the first argument
+	int nworkers = argc > 1 ? atoi(argv[1]) : 1;
+	start_ustack_workers(nworkers, ustack_run);
+
 	ustack_run();
 
 	return 0;
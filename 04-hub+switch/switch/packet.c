@@ -0,0 +1,111 @@
+#include "packet.h"
+#include "log.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+struct packet_buf {
+	struct packet_buf *next;	// next buffer in the freelist
+	int ref;					// number of references, 0 if free
+	char data[ETH_FRAME_LEN] __attribute__((aligned(16)));
+};
+
+static __thread struct packet_buf *local_free;
+static __thread int local_nfree;
+
+static struct packet_buf *shared_free;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct packet_buf *packet_to_buf(char *packet)
+{
+	return (struct packet_buf *)(packet - offsetof(struct packet_buf, data));
+}
+
+// refill the freelist of this thread with a batch of buffers, from the shared
+// freelist if any, or newly allocated ones otherwise
+static int refill_local_free()
+{
+	pthread_mutex_lock(&shared_lock);
+	while (shared_free && local_nfree < PACKET_POOL_BATCH) {
+		struct packet_buf *buf = shared_free;
+		shared_free = buf->next;
+		buf->next = local_free;
+		local_free = buf;
+		local_nfree += 1;
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	if (local_nfree > 0)
+		return 0;
+
+	struct packet_buf *bufs = malloc(sizeof(struct packet_buf) * PACKET_POOL_BATCH);
+	if (!bufs)
+		return -1;
+
+	for (int i = 0; i < PACKET_POOL_BATCH; i++) {
+		bufs[i].next = local_free;
+		local_free = &bufs[i];
+	}
+	local_nfree = PACKET_POOL_BATCH;
+
+	return 0;
+}
+
+// hand a batch of buffers in the freelist of this thread over to the shared
+// one, e.g. when packets received by one thread are free'd by another
+static void drain_local_free()
+{
+	struct packet_buf *head = local_free, *tail = local_free;
+	for (int i = 1; i < PACKET_POOL_BATCH; i++)
+		tail = tail->next;
+
+	local_free = tail->next;
+	local_nfree -= PACKET_POOL_BATCH;
+
+	pthread_mutex_lock(&shared_lock);
+	tail->next = shared_free;
+	shared_free = head;
+	pthread_mutex_unlock(&shared_lock);
+}
+
+char *packet_alloc(int len)
+{
+	if (len > ETH_FRAME_LEN) {
+		log(ERROR, "packet of %d bytes is larger than a frame.", len);
+		return NULL;
+	}
+
+	if (!local_free && refill_local_free() < 0) {
+		log(ERROR, "malloc failed when allocating packet buffers.");
+		return NULL;
+	}
+
+	struct packet_buf *buf = local_free;
+	local_free = buf->next;
+	local_nfree -= 1;
+
+	buf->next = NULL;
+	buf->ref = 1;
+
+	return buf->data;
+}
+
+void packet_hold(char *packet)
+{
+	__atomic_add_fetch(&packet_to_buf(packet)->ref, 1, __ATOMIC_RELAXED);
+}
+
+void packet_free(char *packet)
+{
+	struct packet_buf *buf = packet_to_buf(packet);
+	if (__atomic_sub_fetch(&buf->ref, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	buf->next = local_free;
+	local_free = buf;
+	local_nfree += 1;
+
+	if (local_nfree > PACKET_POOL_CACHE)
+		drain_local_free();
+}
@@ -0,0 +1,418 @@
+// replay frames through handle_packet offline, without network nor superuser
+//
+// The device layer (device_internal.c) is replaced by fake interfaces: frames
+// read from a pcap file, or generated between hosts attached to the
+// interfaces, are handed to handle_packet in a tight loop, and the frames sent
+// by the switch are counted and dropped.
+//
+// Build it by ``make replay'', or by ``make replay PROFILE=1'' to report the
+// time spent in each function as well.
+//
+// usage: ./replay [-i ifaces] [-h hosts] [-n frames] [-l loops] [-p port] [file.pcap]
+
+#define _GNU_SOURCE
+
+#include "base.h"
+#include "ether.h"
+#include "mac.h"
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+
+// length of the generated frames, the minimum ethernet frame without fcs
+#define REPLAY_FRAME_LEN	60
+
+typedef struct {
+	int port;					// index of the receiving interface
+	int len;
+	char *data;
+} replay_frame_t;
+
+ustack_t *instance;
+
+static int nifs = 4;
+static int nhosts = 16;
+
+static replay_frame_t *frames;
+static int nframes;
+
+static u64 sent_frames, sent_bytes;
+
+static u64 now_ns() __attribute__((no_instrument_function));
+static u64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the fake device layer: no fd is opened, no frame is received by
+// iface_recv_packets, and the frames sent are only counted
+
+iface_info_t *fd_to_iface(int fd)
+{
+	return NULL;
+}
+
+iface_info_t *index_to_iface(int index)
+{
+	if (index > 0 && index <= instance->max_index)
+		return instance->index_ifaces[index];
+	return NULL;
+}
+
+int iface_recv_packets(iface_info_t *iface, int budget)
+{
+	return 0;
+}
+
+void iface_send_packet(iface_info_t *iface, const char *packet, int len)
+{
+	sent_frames += 1;
+	sent_bytes += len;
+}
+
+void iface_flood_packet(iface_info_t *iface, const char *packet, int len)
+{
+	for (int i = 0; i < instance->nifs; i++) {
+		if (&instance->ifaces[i] != iface)
+			iface_send_packet(&instance->ifaces[i], packet, len);
+	}
+}
+
+int ustack_add_timer(int interval_ms, ustack_timer_handler func, void *arg)
+{
+	return 0;
+}
+
+int ustack_handle_event(struct epoll_event *ev)
+{
+	return 0;
+}
+
+int ustack_worker_id()
+{
+	return 0;
+}
+
+void start_ustack_workers(int nworkers, void (*run)())
+{
+}
+
+// interface i is s-eth<i>, with ifindex i+1 and mac 02:00:00:01:00:<i>
+void init_ustack()
+{
+	instance = malloc(sizeof(ustack_t));
+	bzero(instance, sizeof(ustack_t));
+	init_list_head(&instance->iface_list);
+
+	instance->nifs = nifs;
+	instance->ifaces = malloc(sizeof(iface_info_t) * nifs);
+	bzero(instance->ifaces, sizeof(iface_info_t) * nifs);
+	instance->nworkers = 1;
+	instance->max_fd = -1;
+	instance->max_index = nifs;
+	instance->index_ifaces = malloc(sizeof(iface_info_t *) * (nifs + 1));
+	bzero(instance->index_ifaces, sizeof(iface_info_t *) * (nifs + 1));
+
+	for (int i = 0; i < nifs; i++) {
+		iface_info_t *iface = &instance->ifaces[i];
+		iface->socks[0].fd = -1;
+		iface->index = i + 1;
+		u8 mac[ETH_ALEN] = { 0x02, 0, 0, 0x01, 0, i };
+		memcpy(iface->mac, mac, ETH_ALEN);
+		sprintf(iface->name, "s-eth%d", (u8)i);
+
+		init_list_head(&iface->list);
+		list_add_tail(&iface->list, &instance->iface_list);
+		instance->index_ifaces[iface->index] = iface;
+	}
+}
+
+// host h is attached to port h % nifs, with mac 02:00:00:00:<h>
+static int host_port(int h)
+{
+	return h % nifs;
+}
+
+static void host_mac(int h, u8 mac[ETH_ALEN])
+{
+	u8 m[ETH_ALEN] = { 0x02, 0, 0, 0, h >> 8, h & 0xff };
+	memcpy(mac, m, ETH_ALEN);
+}
+
+// generate n frames, each one from a random host to a random host on another
+// port
+static void generate_frames(int n)
+{
+	frames = malloc(sizeof(replay_frame_t) * n);
+
+	srand(1);
+	for (int i = 0; i < n; i++) {
+		int src = rand() % nhosts, dst;
+		do {
+			dst = rand() % nhosts;
+		} while (host_port(dst) == host_port(src));
+
+		char *data = malloc(REPLAY_FRAME_LEN);
+		bzero(data, REPLAY_FRAME_LEN);
+
+		struct ether_header *eh = (struct ether_header *)data;
+		host_mac(dst, eh->ether_dhost);
+		host_mac(src, eh->ether_shost);
+		eh->ether_type = htons(ETH_P_IP);
+
+		frames[i].port = host_port(src);
+		frames[i].len = REPLAY_FRAME_LEN;
+		frames[i].data = data;
+	}
+	nframes = n;
+}
+
+static u32 pcap_u32(u32 v, int swapped)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+// load the ethernet frames in a pcap file, all of them received by port
+static int load_pcap(const char *path, int port)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		perror("Open pcap file failed");
+		return -1;
+	}
+
+	struct {
+		u32 magic;
+		u16 major, minor;
+		u32 thiszone, sigfigs, snaplen, linktype;
+	} hdr;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+		fprintf(stderr, "%s is not a pcap file.\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	// microsecond or nanosecond timestamps, in either byte order
+	int swapped = hdr.magic == 0xd4c3b2a1 || hdr.magic == 0x4d3cb2a1;
+	if (!swapped && hdr.magic != 0xa1b2c3d4 && hdr.magic != 0xa1b23c4d) {
+		fprintf(stderr, "%s is not a pcap file.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	if (pcap_u32(hdr.linktype, swapped) != 1) {
+		fprintf(stderr, "%s is not captured on ethernet.\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	int cap = 1024;
+	frames = malloc(sizeof(replay_frame_t) * cap);
+
+	u32 rec[4];				// ts_sec, ts_usec, incl_len, orig_len
+	char buf[65536];
+	while (fread(rec, sizeof(rec), 1, fp) == 1) {
+		u32 len = pcap_u32(rec[2], swapped);
+		if (len > sizeof(buf) || fread(buf, len, 1, fp) != 1)
+			break;
+		if (len < ETHER_HDR_SIZE)
+			continue;
+		if (len > ETH_FRAME_LEN)
+			len = ETH_FRAME_LEN;
+
+		if (nframes == cap) {
+			cap *= 2;
+			frames = realloc(frames, sizeof(replay_frame_t) * cap);
+		}
+		frames[nframes].port = port;
+		frames[nframes].len = len;
+		frames[nframes].data = malloc(len);
+		memcpy(frames[nframes].data, buf, len);
+		nframes += 1;
+	}
+
+	fclose(fp);
+	return nframes;
+}
+
+#ifdef REPLAY_PROFILE
+// with -finstrument-functions, each function is timed when entered and
+// exited by the hooks below; its self time excludes the time of its callees.
+// Only the replaying thread is profiled.
+#define PROF_FUNCS	1024
+#define PROF_DEPTH	256
+
+typedef struct {
+	void *fn;
+	u64 calls;
+	u64 total;
+	u64 self;
+} prof_func_t;
+
+typedef struct {
+	prof_func_t *func;
+	u64 start;
+	u64 children;
+} prof_frame_t;
+
+static prof_func_t prof_funcs[PROF_FUNCS];
+static __thread prof_frame_t prof_stack[PROF_DEPTH];
+static __thread int prof_depth;
+static __thread int profiling;
+
+void __cyg_profile_func_enter(void *fn, void *site) __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *fn, void *site) __attribute__((no_instrument_function));
+
+static prof_func_t *prof_lookup(void *fn) __attribute__((no_instrument_function));
+static prof_func_t *prof_lookup(void *fn)
+{
+	unsigned long key = (unsigned long)fn >> 4;
+	for (int i = 0; i < PROF_FUNCS; i++) {
+		prof_func_t *func = &prof_funcs[(key + i) % PROF_FUNCS];
+		if (func->fn == fn)
+			return func;
+		if (!func->fn) {
+			func->fn = fn;
+			return func;
+		}
+	}
+	return NULL;
+}
+
+void __cyg_profile_func_enter(void *fn, void *site)
+{
+	if (!profiling)
+		return;
+
+	if (prof_depth < PROF_DEPTH) {
+		prof_frame_t *frame = &prof_stack[prof_depth];
+		frame->func = prof_lookup(fn);
+		frame->children = 0;
+		frame->start = now_ns();
+	}
+	prof_depth += 1;
+}
+
+void __cyg_profile_func_exit(void *fn, void *site)
+{
+	if (!profiling || prof_depth == 0)
+		return;
+
+	prof_depth -= 1;
+	if (prof_depth >= PROF_DEPTH)
+		return;
+
+	prof_frame_t *frame = &prof_stack[prof_depth];
+	u64 elapsed = now_ns() - frame->start;
+	if (frame->func) {
+		frame->func->calls += 1;
+		frame->func->total += elapsed;
+		frame->func->self += elapsed - frame->children;
+	}
+	if (prof_depth > 0)
+		prof_stack[prof_depth - 1].children += elapsed;
+}
+
+static int prof_cmp(const void *a, const void *b)
+{
+	const prof_func_t *x = a, *y = b;
+	return x->self < y->self ? 1 : (x->self > y->self ? -1 : 0);
+}
+
+// print the functions taking the most self time; a static function has no
+// dynamic symbol, its offset is printed for ``addr2line -f -e replay''
+static void prof_report(u64 count)
+{
+	qsort(prof_funcs, PROF_FUNCS, sizeof(prof_func_t), prof_cmp);
+
+	printf("%10s %10s %10s  %s\n", "self ns", "total ns", "calls", "function (per frame)");
+	for (int i = 0; i < PROF_FUNCS && i < 25 && prof_funcs[i].fn; i++) {
+		prof_func_t *func = &prof_funcs[i];
+		Dl_info info;
+		char name[64];
+		if (dladdr(func->fn, &info) && info.dli_sname && info.dli_saddr == func->fn)
+			snprintf(name, sizeof(name), "%s", info.dli_sname);
+		else if (dladdr(func->fn, &info))
+			snprintf(name, sizeof(name), "0x%lx", \
+					(unsigned long)((char *)func->fn - (char *)info.dli_fbase));
+		else
+			snprintf(name, sizeof(name), "%p", func->fn);
+
+		printf("%10.1f %10.1f %10.2f  %s\n", (double)func->self / count, \
+				(double)func->total / count, (double)func->calls / count, name);
+	}
+}
+#endif
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-i ifaces] [-h hosts] [-n frames] [-l loops] [-p port] [file.pcap]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ngen = 100000, loops = 10, port = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:h:n:l:p:")) != -1) {
+		switch (opt) {
+			case 'i': nifs = atoi(optarg); break;
+			case 'h': nhosts = atoi(optarg); break;
+			case 'n': ngen = atoi(optarg); break;
+			case 'l': loops = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (nifs < 2 || nifs > 255 || nhosts < nifs || nhosts > 65536 || \
+			ngen <= 0 || loops <= 0 || port < 0 || port >= nifs)
+		usage(argv[0]);
+
+	init_ustack();
+	init_mac_port_table();
+
+	if (optind < argc) {
+		if (load_pcap(argv[optind], port) <= 0)
+			exit(1);
+	}
+	else {
+		generate_frames(ngen);
+	}
+
+#ifdef REPLAY_PROFILE
+	profiling = 1;
+#endif
+	u64 start = now_ns();
+	for (int l = 0; l < loops; l++) {
+		for (int i = 0; i < nframes; i++) {
+			replay_frame_t *frame = &frames[i];
+			char *packet = packet_alloc(frame->len);
+			memcpy(packet, frame->data, frame->len);
+			handle_packet(&instance->ifaces[frame->port], packet, frame->len);
+		}
+	}
+	u64 elapsed = now_ns() - start;
+#ifdef REPLAY_PROFILE
+	profiling = 0;
+#endif
+
+	u64 count = (u64)nframes * loops;
+	printf("replayed %llu frames in %.3f s: %.0f pps, %.1f ns/frame\n", \
+			(unsigned long long)count, \
+			elapsed / 1e9, count * 1e9 / elapsed, (double)elapsed / count);
+	printf("sent %llu frames, %llu bytes\n", (unsigned long long)sent_frames, \
+			(unsigned long long)sent_bytes);
+
+#ifdef REPLAY_PROFILE
+	prof_report(count);
+#endif
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+int trace_enabled;
+
+static const char *trace_names[] = {
+	[TRACE_PACKET_IN] = "packet_in",
+	[TRACE_LOOKUP] = "lookup",
+	[TRACE_SEND] = "send",
+};
+
+static __thread trace_ring_t *trace_local;
+
+// the rings are never free'd, so that the records of exited threads are kept
+static trace_ring_t *trace_rings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// allocate the ring of this thread, and link it for dump_trace
+static trace_ring_t *trace_register()
+{
+	trace_ring_t *ring = malloc(sizeof(trace_ring_t));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(trace_ring_t));
+
+	pthread_mutex_lock(&trace_lock);
+	ring->next = trace_rings;
+	__atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_local = ring;
+	return ring;
+}
+
+void trace_record(enum trace_event event, iface_info_t *iface, u64 arg0, u64 arg1)
+{
+	trace_ring_t *ring = trace_local ? trace_local : trace_register();
+	if (!ring)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	trace_record_t *record = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+	record->ns = (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	record->event = event;
+	record->iface = iface ? iface - instance->ifaces : -1;
+	record->arg0 = arg0;
+	record->arg1 = arg1;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void set_trace_enabled(int enabled)
+{
+	__atomic_store_n(&trace_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+static void dump_trace_record(FILE *fp, trace_record_t *record)
+{
+	const char *name = "-";
+	if (record->iface >= 0 && record->iface < instance->nifs)
+		name = instance->ifaces[record->iface].name;
+
+	fprintf(fp, "%llu.%09llu %s", (unsigned long long)(record->ns / 1000000000ULL), \
+			(unsigned long long)(record->ns % 1000000000ULL), trace_names[record->event]);
+
+	switch (record->event) {
+		case TRACE_PACKET_IN:
+		case TRACE_SEND:
+			fprintf(fp, " %s %llu bytes\n", name, (unsigned long long)record->arg0);
+			break;
+		case TRACE_LOOKUP: {
+			u8 *mac = (u8 *)&record->arg0;
+			fprintf(fp, " " ETHER_STRING " -> %s\n", ETHER_FMT(mac), name);
+			break;
+		}
+		default:
+			fprintf(fp, "\n");
+			break;
+	}
+}
+
+// dump the records in the rings of all the threads, the oldest ones first in
+// each ring; the records written meanwhile may be torn, so disable tracing
+// before dumping for a consistent view
+void dump_trace(FILE *fp)
+{
+	trace_ring_t *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		u64 from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		fprintf(fp, "thread ring: %llu records\n", (unsigned long long)(head - from));
+		for (u64 i = from; i < head; i++)
+			dump_trace_record(fp, &ring->records[i & (TRACE_RING_SIZE - 1)]);
+	}
+}
@@ -9,6 +9,9 @@
 
 #define STP_MAX_PORTS 32
 
+// the stp timers are checked every STP_TIMER_INTERVAL ms, about one tick
+#define STP_TIMER_INTERVAL 4
+
 extern const u8 eth_stp_addr[];
 
 enum stp_port_state {
@@ -50,7 +53,6 @@ struct stp {
 	stp_port_t ports[STP_MAX_PORTS];
 
 	pthread_mutex_t lock;
-	pthread_t timer_thread;
 };
 
 void stp_init(struct list_head *iface_list);
@@ -130,21 +130,16 @@ static void stp_port_init(stp_port_t *p)
 	p->designated_cost = stp->root_path_cost;
 }
 
-void *stp_timer_routine(void *arg)
+// run the expired stp timers, ustack_run calls it every STP_TIMER_INTERVAL ms
+static void stp_timer_routine(void *arg)
 {
-	while (true) {
-		long long int now = time_tick_now();
+	long long int now = time_tick_now();
 
-		pthread_mutex_lock(&stp->lock);
-
-		stp_timer_run_once(now);
-
-		pthread_mutex_unlock(&stp->lock);
+	pthread_mutex_lock(&stp->lock);
 
-		usleep(100);
-	}
+	stp_timer_run_once(now);
 
-	return NULL;
+	pthread_mutex_unlock(&stp->lock);
 }
 
 // 比较两个端口的优先级, 若 p1 优先级更高则返回 true
@@ -379,15 +374,13 @@ void stp_init(struct list_head *iface_list)
 	}
 
 	pthread_mutex_init(&stp->lock, NULL);
-	pthread_create(&stp->timer_thread, NULL, stp_timer_routine, NULL);
+	ustack_add_timer(STP_TIMER_INTERVAL, stp_timer_routine, NULL);
 
 	signal(SIGTERM, stp_handle_signal);
 }
 
 void stp_destroy()
 {
-	pthread_kill(stp->timer_thread, SIGKILL);
-
 	for (int i = 0; i < stp->nports; i++) {
 		stp_port_t *port = &stp->ports[i];
 		port->iface->port = NULL;
@@ -3,13 +3,13 @@
 #include "types.h"
 #include "ether.h"
 #include "arpcache.h"
+#include "packet.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// #include "log.h"
-
 // send an arp request: encapsulate an arp request packet, send it out through
 // iface_send_packet
 void arp_send_request(iface_info_t *iface, u32 dst_ip)
@@ -17,7 +17,9 @@ void arp_send_request(iface_info_t *iface, u32 dst_ip)
 	// fprintf(stderr, "TODO: send arp request when lookup failed in arpcache.\n");
 
 	// Malloc space for ethernet header + arp header
-	char* packet = malloc(ETHER_HDR_SIZE + ETHER_ARP_SIZE);
+	char* packet = packet_alloc(ETHER_HDR_SIZE + ETHER_ARP_SIZE);
+	if (!packet)
+		return;
 	struct ether_header* eh = (struct ether_header *)packet;
 	struct ether_arp* arp_req = (struct ether_arp *)(packet + ETHER_HDR_SIZE);
 
@@ -48,7 +50,9 @@ void arp_send_reply(iface_info_t *iface, struct ether_arp *req_hdr)
 	// fprintf(stderr, "TODO: send arp reply when receiving arp request.\n");
 
 	// Malloc space for ethernet header + arp header
-	char* packet = malloc(ETHER_HDR_SIZE + ETHER_ARP_SIZE);
+	char* packet = packet_alloc(ETHER_HDR_SIZE + ETHER_ARP_SIZE);
+	if (!packet)
+		return;
 	struct ether_header* eh = (struct ether_header *)packet;
 	struct ether_arp* arp_rpl = (struct ether_arp *)(packet + ETHER_HDR_SIZE);
 
@@ -83,14 +87,14 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 	u32 arp_spa = ntohl(arp_hdr->arp_spa);
 
 	if (arp_op == ARPOP_REQUEST) {
-		// log(DEBUG, "receive arp request, send arp reply");
+		log_debug("receive arp request, send arp reply");
 		if (arp_tpa == iface->ip) {
 			// Self is being asked, send arp reply
 			arp_send_reply(iface, arp_hdr);
 		}
 	}
 	else {  // is ARPOP_REPLY
-		// log(DEBUG, "receive arp reply");
+		log_debug("receive arp reply");
 		if (arp_tpa == iface->ip) {
 			// Self is answered, save it into arpcache
 			u8 new_mac[ETH_ALEN];
@@ -98,6 +102,32 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 			arpcache_insert(arp_spa, new_mac);
 		}
 	}
+
+	packet_free(packet);
+}
+
+// send (IP) packet to the next hop whose mac address is known: fill the
+// ethernet header and emit the packet by iface_send_packet
+void iface_send_packet_to_mac(iface_info_t *iface, const u8 dst_mac[ETH_ALEN], char *packet, int len)
+{
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(eh->ether_dhost, dst_mac, ETH_ALEN);
+	memcpy(eh->ether_shost, iface->mac, ETH_ALEN);
+	eh->ether_type = htons(ETH_P_IP);
+
+	iface_send_packet(iface, packet, len);
+}
+
+// pend the (IP) packet into arpcache, and send arp request if necessary
+void iface_pend_packet_by_arp(iface_info_t *iface, u32 dst_ip, char *packet, int len)
+{
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(eh->ether_shost, iface->mac, ETH_ALEN);
+	eh->ether_type = htons(ETH_P_IP);
+
+	log_debug("lookup %x failed, pend this packet", dst_ip);
+	trace(TRACE_ARP_MISS, iface, dst_ip, 0);
+	arpcache_append_packet(iface, dst_ip, packet, len);
 }
 
 // send (IP) packet through arpcache lookup 
@@ -107,19 +137,13 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 // this packet into arpcache, and send arp request.
 void iface_send_packet_by_arp(iface_info_t *iface, u32 dst_ip, char *packet, int len)
 {
-	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(eh->ether_shost, iface->mac, ETH_ALEN);
-	eh->ether_type = htons(ETH_P_IP);
-
 	u8 dst_mac[ETH_ALEN];
 	int found = arpcache_lookup(dst_ip, dst_mac);
 	if (found) {
-		// log(DEBUG, "found the mac of %x, send this packet", dst_ip);
-		memcpy(eh->ether_dhost, dst_mac, ETH_ALEN);
-		iface_send_packet(iface, packet, len);
+		log_debug("found the mac of %x, send this packet", dst_ip);
+		iface_send_packet_to_mac(iface, dst_mac, packet, len);
 	}
 	else {
-		// log(DEBUG, "lookup %x failed, pend this packet", dst_ip);
-		arpcache_append_packet(iface, dst_ip, packet, len);
+		iface_pend_packet_by_arp(iface, dst_ip, packet, len);
 	}
 }
@@ -1,26 +1,125 @@
 #include "arpcache.h"
 #include "arp.h"
 #include "ether.h"
+#include "flowcache.h"
 #include "icmp.h"
+#include "packet.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
 static arpcache_t arpcache;
 
-// initialize IP->mac mapping, request list, lock and sweeping thread
+static arp_table_t *new_arp_table(u32 size)
+{
+	arp_table_t *table = malloc(sizeof(arp_table_t) + size * sizeof(struct arp_cache_entry));
+	if (!table) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	bzero(table, sizeof(arp_table_t) + size * sizeof(struct arp_cache_entry));
+	table->size = size;
+
+	return table;
+}
+
+// the slot where the probing for ip4 starts (fibonacci hashing)
+static inline u32 arp_table_slot(arp_table_t *table, u32 ip4)
+{
+	return (ip4 * 2654435769u) >> (32 - __builtin_ctz(table->size));
+}
+
+// find the slot of ip4, or the empty slot ending its probe sequence
+static struct arp_cache_entry *arp_table_find(arp_table_t *table, u32 ip4)
+{
+	u32 mask = table->size - 1;
+	u32 i = arp_table_slot(table, ip4);
+	while (table->entries[i].valid && table->entries[i].ip4 != ip4)
+		i = (i + 1) & mask;
+
+	return &table->entries[i];
+}
+
+// begin and end a change of the table, with arpcache.lock held
+static inline void arp_table_write_begin()
+{
+	__atomic_store_n(&arpcache.seq, arpcache.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void arp_table_write_end()
+{
+	__atomic_store_n(&arpcache.seq, arpcache.seq + 1, __ATOMIC_RELEASE);
+}
+
+// move all the entries into a table twice as large
+static void arp_table_grow()
+{
+	arp_table_t *old = arpcache.table;
+	arp_table_t *table = new_arp_table(old->size * 2);
+
+	for (u32 i = 0; i < old->size; i++) {
+		if (old->entries[i].valid) {
+			*arp_table_find(table, old->entries[i].ip4) = old->entries[i];
+			table->count++;
+		}
+	}
+
+	table->retired = old;
+	__atomic_store_n(&arpcache.table, table, __ATOMIC_RELEASE);
+}
+
+// remove the entry at slot i: the entries after it in the same cluster are
+// shifted back, unless they would move before their own starting slot
+static void arp_table_remove(arp_table_t *table, u32 i)
+{
+	u32 mask = table->size - 1;
+	u32 hole = i;
+
+	for (u32 j = (i + 1) & mask; table->entries[j].valid; j = (j + 1) & mask) {
+		u32 slot = arp_table_slot(table, table->entries[j].ip4);
+		// move entry j to the hole if its slot is not cyclically in (hole, j]
+		if (((j - slot) & mask) >= ((j - hole) & mask)) {
+			table->entries[hole] = table->entries[j];
+			hole = j;
+		}
+	}
+
+	table->entries[hole].valid = 0;
+	table->count--;
+}
+
+// the bucket of the requests for ip4
+static inline struct list_head *arp_req_bucket(u32 ip4)
+{
+	return &arpcache.req_hash[(ip4 * 2654435769u) >> (32 - ARP_REQ_HASH_BITS)];
+}
+
+// unlink the request from the request list and its bucket
+static void unlink_arp_req(struct arp_req *req_entry)
+{
+	list_delete_entry(&(req_entry->list));
+	list_delete_entry(&(req_entry->hash_list));
+	arpcache.nreqs -= 1;
+}
+
+// initialize IP->mac mapping, request list, lock and sweeping timer
 void arpcache_init()
 {
 	bzero(&arpcache, sizeof(arpcache_t));
 
+	arpcache.table = new_arp_table(ARP_TABLE_INIT_SIZE);
+
 	init_list_head(&(arpcache.req_list));
+	for (int i = 0; i < ARP_REQ_HASH_SIZE; i++)
+		init_list_head(&(arpcache.req_hash[i]));
 
 	pthread_mutex_init(&arpcache.lock, NULL);
 
-	pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
+	ustack_add_timer(1000, arpcache_sweep, NULL);
 }
 
 // release all the resources when exiting
@@ -33,149 +132,193 @@ void arpcache_destroy()
 		struct cached_pkt *pkt_entry = NULL, *pkt_q;
 		list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
 			list_delete_entry(&(pkt_entry->list));
-			free(pkt_entry->packet);
+			packet_free(pkt_entry->packet);
 			free(pkt_entry);
 		}
 
-		list_delete_entry(&(req_entry->list));
+		unlink_arp_req(req_entry);
 		free(req_entry);
 	}
 
-	pthread_kill(arpcache.thread, SIGTERM);
+	arp_table_t *table = arpcache.table, *next;
+	for (; table; table = next) {
+		next = table->retired;
+		free(table);
+	}
+	arpcache.table = NULL;
 
 	pthread_mutex_unlock(&arpcache.lock);
 }
 
 // lookup the IP->mac mapping
 //
-// traverse the table to find whether there is an entry with the same IP
-// and mac address with the given arguments
+// probe the table to find whether there is an entry with the same IP, and
+// copy its mac address if so. The lookup takes no lock, and retries if the
+// table is changed meanwhile.
 int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN])
 {
 	// fprintf(stderr, "TODO: lookup ip address in arp cache.\n");
-	pthread_mutex_lock(&arpcache.lock);
-
-	struct arp_cache_entry *entry = NULL;
-
-	for (int i = 0; i < MAX_ARP_SIZE; i++) {
-		entry = &arpcache.entries[i];
-		if (entry->valid && entry->ip4 == ip4) {
-			memcpy(mac, entry->mac, ETH_ALEN);
-			pthread_mutex_unlock(&arpcache.lock);
-			return 1;
-		}
+	struct arp_cache_entry entry;
+	u32 seq;
+
+	do {
+		while ((seq = __atomic_load_n(&arpcache.seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		arp_table_t *table = __atomic_load_n(&arpcache.table, __ATOMIC_ACQUIRE);
+		entry = *arp_table_find(table, ip4);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&arpcache.seq, __ATOMIC_RELAXED) != seq);
+
+	if (entry.valid) {
+		memcpy(mac, entry.mac, ETH_ALEN);
+		stats_inc(STATS_ARP_HIT);
+		return 1;
 	}
-	
-	pthread_mutex_unlock(&arpcache.lock);
+
+	stats_inc(STATS_ARP_MISS);
 	return 0;
 }
 
 // append the packet to arpcache
 //
-// Lookup in the list which stores pending packets, if there is already an
-// entry with the same IP address and iface (which means the corresponding arp
-// request has been sent out), just append this packet at the tail of that entry
-// (the entry may contain more than one packet); otherwise, malloc a new entry
-// with the given IP address and iface, append the packet, and send arp request.
+// Lookup in the hash table which indexes pending packets, if there is already
+// an entry with the same IP address and iface (which means the corresponding
+// arp request has been sent out), just append this packet at the tail of that
+// entry (the entry may contain more than one packet, and its oldest one is
+// dropped if it is full); otherwise, malloc a new entry with the given IP
+// address and iface, append the packet, and send arp request, unless too many
+// requests are pending, when the packet is dropped.
+// The packet is owned by arpcache afterwards, instead of being copied.
 void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 {
 	// fprintf(stderr, "TODO: append the ip address if lookup failed, and send arp request if necessary.\n");
 
 	pthread_mutex_lock(&arpcache.lock);
 
-	struct cached_pkt *new_pkt = (struct cached_pkt *)malloc(sizeof(struct cached_pkt));
-	new_pkt->packet = (char *)malloc(len);
-	memcpy(new_pkt->packet, packet, len);
-	new_pkt->len = len;
-
 	int found = 0;
 	struct arp_req *req_entry = NULL;
-	list_for_each_entry(req_entry, &(arpcache.req_list), list) {
+	list_for_each_entry(req_entry, arp_req_bucket(ip4), hash_list) {
 		if (req_entry->ip4 == ip4 && req_entry->iface == iface) {
 			found = 1;
 			break;
 		}
 	}
 
+	struct cached_pkt *new_pkt = NULL;
 	if (!found) {
+		if (arpcache.nreqs >= ARP_PENDING_MAX_REQUESTS) {
+			pthread_mutex_unlock(&arpcache.lock);
+			stats_inc(STATS_ARP_DROP_REQUEST);
+			packet_free(packet);
+			return;
+		}
+
 		// create a new arp_req entry
 		req_entry = (struct arp_req *)malloc(sizeof(struct arp_req));
 		req_entry->iface = iface;
 		req_entry->ip4 = ip4;
 		req_entry->sent = time(NULL);
 		req_entry->retries = 0;
+		req_entry->npackets = 0;
 
 		init_list_head(&(req_entry->cached_packets));
 		list_add_tail(&(req_entry->list), &(arpcache.req_list));
-		list_add_tail(&(new_pkt->list), &(req_entry->cached_packets));
+		list_add_tail(&(req_entry->hash_list), arp_req_bucket(ip4));
+		arpcache.nreqs += 1;
 
+		stats_inc(STATS_ARP_REQUEST);
 		arp_send_request(iface, ip4);
 	}
-	else {
-		list_add_tail(&(new_pkt->list), &(req_entry->cached_packets));
+	else if (req_entry->npackets >= ARP_PENDING_MAX_PACKETS) {
+		// drop the oldest packet, and reuse its entry for the new one
+		new_pkt = list_entry(req_entry->cached_packets.next, struct cached_pkt, list);
+		list_delete_entry(&(new_pkt->list));
+		packet_free(new_pkt->packet);
+		req_entry->npackets -= 1;
+		stats_inc(STATS_ARP_DROP_QUEUE);
 	}
 
+	if (!new_pkt)
+		new_pkt = (struct cached_pkt *)malloc(sizeof(struct cached_pkt));
+	new_pkt->packet = packet;
+	new_pkt->len = len;
+	list_add_tail(&(new_pkt->list), &(req_entry->cached_packets));
+	req_entry->npackets += 1;
+	stats_inc(STATS_ARP_PENDING);
+
 	pthread_mutex_unlock(&arpcache.lock);
 }
 
 // insert the IP->mac mapping into arpcache, if there are pending packets
 // waiting for this mapping, fill the ethernet header for each of them, and send
 // them out
+//
+// The requests resolved are detached with the lock held, and their packets are
+// sent after it is released, so that a long backlog does not hold up the other
+// threads. When the arp reply is handled in iface_recv_packets, the packets are
+// then sent in one batch with the frames of the other received ones.
 void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 {
 	// fprintf(stderr, "TODO: insert ip->mac entry, and send all the pending packets.\n");
+	struct list_head resolved_list;
+	init_list_head(&resolved_list);
+
 	pthread_mutex_lock(&arpcache.lock);
 
-	int pos = 0;
-
-	// Find the first empty slot
-	for (int i = 0; i < MAX_ARP_SIZE; i++) {
-		if (!arpcache.entries[i].valid) {
-			pos = i;
-			break;
-		}
-	}
+	arp_table_write_begin();
 
 	// If the IP->mac mapping exists, update it instead
-	for (int i = 0; i < MAX_ARP_SIZE; i++) {
-		if (arpcache.entries[i].valid && arpcache.entries[i].ip4 == ip4) {
-			// Update the mac address and added time
-			pos = i;
-			break;
+	struct arp_cache_entry *entry = arp_table_find(arpcache.table, ip4);
+	int moved = entry->valid && memcmp(entry->mac, mac, ETH_ALEN) != 0;
+	if (!entry->valid) {
+		if ((arpcache.table->count + 1) * 2 > arpcache.table->size) {
+			arp_table_grow();
+			entry = arp_table_find(arpcache.table, ip4);
 		}
+		arpcache.table->count++;
 	}
 
-	arpcache.entries[pos].ip4 = ip4;
-	memcpy(arpcache.entries[pos].mac, mac, ETH_ALEN);
-	arpcache.entries[pos].added = time(NULL);
-	arpcache.entries[pos].valid = 1;
+	entry->ip4 = ip4;
+	memcpy(entry->mac, mac, ETH_ALEN);
+	entry->added = time(NULL);
+	entry->valid = 1;
+
+	arp_table_write_end();
+
+	// the next hop cached for some destinations has moved
+	if (moved)
+		flow_cache_invalidate();
 
 	// Check if there are pending packets waiting for this mapping
 	struct arp_req *req_entry = NULL, *req_q;
-	list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
+	list_for_each_entry_safe(req_entry, req_q, arp_req_bucket(ip4), hash_list) {
 		if (req_entry->ip4 == ip4) {  // Found matching pending packets
-			// Send all pending packets
-			struct cached_pkt *pkt_entry = NULL, *pkt_q;
-			list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
-				struct ether_header *eh = (struct ether_header *)pkt_entry->packet;
-				memcpy(eh->ether_dhost, mac, ETH_ALEN);
-				memcpy(eh->ether_shost, req_entry->iface->mac, ETH_ALEN);
-				eh->ether_type = htons(ETH_P_IP);
-
-				iface_send_packet(req_entry->iface, pkt_entry->packet, pkt_entry->len);
-				list_delete_entry(&(pkt_entry->list));
-				free(pkt_entry);
-			}
-			// Remove the arp_req entry
-			list_delete_entry(&(req_entry->list));
-			free(req_entry);
+			unlink_arp_req(req_entry);
+			list_add_tail(&(req_entry->list), &resolved_list);
 		}
 	}
 
 	pthread_mutex_unlock(&arpcache.lock);
+
+	// Send all pending packets, and remove the arp_req entries
+	list_for_each_entry_safe(req_entry, req_q, &resolved_list, list) {
+		struct cached_pkt *pkt_entry = NULL, *pkt_q;
+		list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
+			struct ether_header *eh = (struct ether_header *)pkt_entry->packet;
+			memcpy(eh->ether_dhost, mac, ETH_ALEN);
+			memcpy(eh->ether_shost, req_entry->iface->mac, ETH_ALEN);
+			eh->ether_type = htons(ETH_P_IP);
+
+			iface_send_packet(req_entry->iface, pkt_entry->packet, pkt_entry->len);
+			list_delete_entry(&(pkt_entry->list));
+			free(pkt_entry);
+		}
+		list_delete_entry(&(req_entry->list));
+		free(req_entry);
+	}
 }
 
-// sweep arpcache periodically
+// sweep arpcache periodically, ustack_run calls it every second
 //
 // For the IP->mac entry, if the entry has been in the table for more than 15
 // seconds, remove it from the table.
@@ -184,58 +327,67 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 // request has been sent 5 times without receiving arp reply, for each
 // pending packet, send icmp packet (DEST_HOST_UNREACHABLE), and drop these
 // packets.
-void *arpcache_sweep(void *arg) 
+void arpcache_sweep(void *arg)
 {
-	while (1) {
-		sleep(1);
-		// fprintf(stderr, "TODO: sweep arpcache periodically: remove old entries, resend arp requests .\n");
-		pthread_mutex_lock(&arpcache.lock);
-
-		struct list_head unreachable_list;
-		init_list_head(&unreachable_list);
-
-		time_t now = time(NULL);
+	// fprintf(stderr, "TODO: sweep arpcache periodically: remove old entries, resend arp requests .\n");
+	pthread_mutex_lock(&arpcache.lock);
 
-		// IP->mac entries
-		for (int i = 0; i < MAX_ARP_SIZE; i++) {
-			if (arpcache.entries[i].valid &&
-				(now - arpcache.entries[i].added) > ARP_ENTRY_TIMEOUT) {
-				arpcache.entries[i].valid = 0;
+	struct list_head unreachable_list;
+	init_list_head(&unreachable_list);
+
+	time_t now = time(NULL);
+
+	// IP->mac entries; an entry may be shifted back into the slot of a removed
+	// one, so that slot is checked again
+	arp_table_t *table = arpcache.table;
+	int changed = 0;
+	for (u32 i = 0; i < table->size; i++) {
+		while (table->entries[i].valid &&
+			(now - table->entries[i].added) > ARP_ENTRY_TIMEOUT) {
+			if (!changed) {
+				arp_table_write_begin();
+				changed = 1;
 			}
+			arp_table_remove(table, i);
 		}
+	}
+	if (changed) {
+		arp_table_write_end();
+		flow_cache_invalidate();
+	}
 
-		// Pending packets
-		struct arp_req *req_entry = NULL, *req_q;
-		list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
-			if ((now - req_entry->sent) >= 1) {
-				if (req_entry->retries >= ARP_REQUEST_MAX_RETRIES) {
-					list_delete_entry(&(req_entry->list));
-					list_add_tail(&(req_entry->list), &unreachable_list);
-				}
-				else {
-					// Resend ARP request
-					arp_send_request(req_entry->iface, req_entry->ip4);
-					req_entry->sent = now;
-					req_entry->retries += 1;
-				}
+	// Pending packets
+	struct arp_req *req_entry = NULL, *req_q;
+	list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
+		if ((now - req_entry->sent) >= 1) {
+			if (req_entry->retries >= ARP_REQUEST_MAX_RETRIES) {
+				unlink_arp_req(req_entry);
+				list_add_tail(&(req_entry->list), &unreachable_list);
+			}
+			else {
+				// Resend ARP request
+				stats_inc(STATS_ARP_REQUEST);
+				arp_send_request(req_entry->iface, req_entry->ip4);
+				req_entry->sent = now;
+				req_entry->retries += 1;
 			}
 		}
+	}
 
-		pthread_mutex_unlock(&arpcache.lock);
+	pthread_mutex_unlock(&arpcache.lock);
 
-		// Send ICMP DEST_HOST_UNREACHABLE for unreachable packets
-		struct arp_req *unreq_entry = NULL, *unreq_q;
-		list_for_each_entry_safe(unreq_entry, unreq_q, &unreachable_list, list) {
-			struct cached_pkt *pkt_entry = NULL, *pkt_q;
-			list_for_each_entry_safe(pkt_entry, pkt_q, &(unreq_entry->cached_packets), list) {
-				icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-				list_delete_entry(&(pkt_entry->list));
-				free(pkt_entry);
-			}
-			list_delete_entry(&(unreq_entry->list));
-			free(unreq_entry);
+	// Send ICMP DEST_HOST_UNREACHABLE for unreachable packets
+	struct arp_req *unreq_entry = NULL, *unreq_q;
+	list_for_each_entry_safe(unreq_entry, unreq_q, &unreachable_list, list) {
+		struct cached_pkt *pkt_entry = NULL, *pkt_q;
+		list_for_each_entry_safe(pkt_entry, pkt_q, &(unreq_entry->cached_packets), list) {
+			stats_inc(STATS_ARP_UNREACHABLE);
+			icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
+			list_delete_entry(&(pkt_entry->list));
+			packet_free(pkt_entry->packet);
+			free(pkt_entry);
 		}
+		list_delete_entry(&(unreq_entry->list));
+		free(unreq_entry);
 	}
-
-	return NULL;
 }
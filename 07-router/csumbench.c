@@ -0,0 +1,192 @@
+// benchmark the checksum kernels against the loop summing a 16-bit word at a
+// time, over buffers of 20 bytes to 9 KB
+//
+// checksum.c is included here, so that each of its kernels is called directly
+// rather than the one picked for the cpu. Every kernel is checked against the
+// loop on all the lengths up to 9 KB before it is timed, and the kernels the
+// cpu does not support are skipped. The column checksum() is the inline
+// function of checksum.h, which sums the buffers shorter than
+// CHECKSUM_PARTIAL_MIN inline and the others by the picked kernel.
+//
+// Build it by ``make csumbench''.
+//
+// usage: ./csumbench [-n iterations]
+
+#include "checksum.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define CSUMBENCH_MAX	9000
+
+// the checksum as it was summed before checksum_partial
+static u16 checksum_loop(u16 *ptr, int nbytes, u32 sum)
+{
+	if (nbytes % 2) {
+		sum += ((u8 *)ptr)[--nbytes];
+	}
+
+	while (nbytes > 0) {
+		sum += *ptr++;
+		nbytes -= 2;
+	}
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = sum + (sum >> 16);
+
+	return (u16)~sum;
+}
+
+typedef struct {
+	const char *name;
+	u32 (*partial)(const u8 *buf, int nbytes);		// NULL for checksum()
+	int supported;
+} csum_kernel_t;
+
+static csum_kernel_t kernels[] = {
+	{ "scalar64", checksum_partial_scalar, 1 },
+#ifdef CHECKSUM_X86
+	{ "sse2", checksum_partial_sse2, 0 },
+	{ "avx2", checksum_partial_avx2, 0 },
+#endif
+	{ "checksum()", NULL, 1 },
+};
+
+#define NKERNELS	(int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static u64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u16 kernel_checksum(csum_kernel_t *kernel, u8 *buf, int nbytes)
+{
+	if (!kernel->partial)
+		return checksum((u16 *)buf, nbytes, 0);
+
+	u32 sum = kernel->partial(buf, nbytes);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+
+	return (u16)~sum;
+}
+
+// check the kernel against the loop on all the lengths, at an odd address as
+// well, and on a buffer of 0xff bytes, whose sum carries the most
+static int check_kernel(csum_kernel_t *kernel, u8 *buf, u8 *ones)
+{
+	for (int off = 0; off < 2; off++) {
+		for (int n = 0; n <= CSUMBENCH_MAX; n++) {
+			if (kernel_checksum(kernel, buf + off, n) != \
+					checksum_loop((u16 *)(buf + off), n, 0) || \
+					kernel_checksum(kernel, ones, n) != \
+					checksum_loop((u16 *)ones, n, 0)) {
+				fprintf(stderr, "%s: mismatch on %d bytes at offset %d\n", \
+						kernel->name, n, off);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// the time of summing the buffer, in ns; the barrier keeps the compiler from
+// hoisting the sum of the unchanged buffer out of the loop
+static double time_kernel(csum_kernel_t *kernel, u8 *buf, int nbytes, int iters)
+{
+	u32 sink = 0;
+	u64 start = now_ns();
+	for (int i = 0; i < iters; i++) {
+		__asm__ volatile("" ::: "memory");
+		if (!kernel)
+			sink += checksum_loop((u16 *)buf, nbytes, 0);
+		else if (!kernel->partial)
+			sink += checksum((u16 *)buf, nbytes, 0);
+		else
+			sink += kernel_checksum(kernel, buf, nbytes);
+	}
+	u64 elapsed = now_ns() - start;
+
+	__asm__ volatile("" :: "r"(sink));
+
+	return (double)elapsed / iters;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 20, 64, 128, 576, 1500, 4096, 9000 };
+	int iters = 200000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n': iters = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (iters <= 0)
+		usage(argv[0]);
+
+	u8 *buf = malloc(CSUMBENCH_MAX + 2), *ones = malloc(CSUMBENCH_MAX);
+	if (!buf || !ones) {
+		perror("malloc");
+		exit(1);
+	}
+	srand(1);
+	for (int i = 0; i < CSUMBENCH_MAX + 2; i++)
+		buf[i] = rand();
+	memset(ones, 0xff, CSUMBENCH_MAX);
+
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	for (int k = 0; k < NKERNELS; k++) {
+		if (kernels[k].partial == checksum_partial_sse2)
+			kernels[k].supported = __builtin_cpu_supports("sse2");
+		else if (kernels[k].partial == checksum_partial_avx2)
+			kernels[k].supported = __builtin_cpu_supports("avx2");
+	}
+#endif
+
+	for (int k = 0; k < NKERNELS; k++) {
+		if (kernels[k].supported && kernels[k].partial && \
+				!check_kernel(&kernels[k], buf, ones))
+			exit(1);
+	}
+
+	printf("%8s %10s", "bytes", "loop");
+	for (int k = 0; k < NKERNELS; k++)
+		printf(" %10s", kernels[k].name);
+	printf("   (ns per buffer)\n");
+
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		// as many bytes are summed for each size
+		int n = (int)((u64)iters * 64 / sizes[i]);
+		if (n < 1000)
+			n = 1000;
+
+		printf("%8d %10.1f", sizes[i], time_kernel(NULL, buf, sizes[i], n));
+		for (int k = 0; k < NKERNELS; k++) {
+			if (kernels[k].supported)
+				printf(" %10.1f", time_kernel(&kernels[k], buf, sizes[i], n));
+			else
+				printf(" %10s", "-");
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	free(ones);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#include "flowcache.h"
+
+#include <string.h>
+
+// the generation starts from 1, so that an empty entry never matches
+u32 flow_cache_gen = 1;
+
+__thread flow_entry_t flow_cache[FLOW_CACHE_SIZE];
+
+// cache the result of the lookups done in generation gen, replacing the entry
+// of another destination in the same slot if any
+void flow_cache_fill(u32 daddr, u32 gen, iface_info_t *iface, u8 dmac[ETH_ALEN])
+{
+	flow_entry_t *flow = flow_cache_slot(daddr);
+
+	flow->daddr = daddr;
+	flow->gen = gen;
+	flow->iface = iface;
+	memcpy(flow->dmac, dmac, ETH_ALEN);
+}
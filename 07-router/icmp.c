@@ -3,10 +3,95 @@
 #include "rtable.h"
 #include "arp.h"
 #include "base.h"
+#include "packet.h"
+#include "rcu.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// a token bucket, whose tokens are counted in ms of refilling
+typedef struct {
+	u32 ip;					// the source, in host byte order
+	u64 tokens;
+	u64 last;				// the time of the last refill, in ms
+} icmp_bucket_t;
+
+static icmp_bucket_t icmp_buckets[ICMP_RATELIMIT_SIZE];
+static icmp_bucket_t icmp_global = { 0, ICMP_MSGS_BURST * (1000 / ICMP_MSGS_PER_SEC), 0 };
+static pthread_mutex_t icmp_ratelimit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u64 icmp_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// refill the bucket for the time elapsed, up to burst tokens of cost ms each
+static void icmp_bucket_refill(icmp_bucket_t *bucket, u64 now, u64 cost, u64 burst)
+{
+	bucket->tokens += now - bucket->last;
+	if (bucket->tokens > burst * cost)
+		bucket->tokens = burst * cost;
+	bucket->last = now;
+}
+
+// whether an icmp error may be sent to ip (in host byte order) now: a token
+// is taken from the bucket of the source and from the global one, only if
+// both of them have one
+static int icmp_ratelimit_allow(u32 ip)
+{
+	u64 now = icmp_now_ms();
+	u64 global_cost = 1000 / ICMP_MSGS_PER_SEC;
+	icmp_bucket_t *set = &icmp_buckets[((ip * 2654435769u) >> (32 - ICMP_RATELIMIT_BITS)) \
+			& ~(ICMP_RATELIMIT_WAYS - 1)];
+
+	pthread_mutex_lock(&icmp_ratelimit_lock);
+
+	icmp_bucket_t *bucket = NULL, *lru = set;
+	for (int i = 0; i < ICMP_RATELIMIT_WAYS && !bucket; i++) {
+		if (set[i].last != 0 && set[i].ip == ip)
+			bucket = &set[i];
+		else if (set[i].last < lru->last)
+			lru = &set[i];
+	}
+
+	// a source not in its set takes the least recently used entry of it: an
+	// empty one starts with a full bucket, and one of another source with only
+	// the tokens refilled since that source last used it, so that the sources
+	// cycling through a set cannot get a new burst each time
+	if (!bucket) {
+		bucket = lru;
+		if (bucket->last == 0) {
+			bucket->tokens = ICMP_RATELIMIT_BURST * ICMP_RATELIMIT_MS;
+			bucket->last = now;
+		}
+		else {
+			bucket->tokens = 0;
+		}
+		bucket->ip = ip;
+	}
+
+	if (icmp_global.last == 0)
+		icmp_global.last = now;
+
+	icmp_bucket_refill(bucket, now, ICMP_RATELIMIT_MS, ICMP_RATELIMIT_BURST);
+	icmp_bucket_refill(&icmp_global, now, global_cost, ICMP_MSGS_BURST);
+
+	int allow = bucket->tokens >= ICMP_RATELIMIT_MS && icmp_global.tokens >= global_cost;
+	if (allow) {
+		bucket->tokens -= ICMP_RATELIMIT_MS;
+		icmp_global.tokens -= global_cost;
+	}
+
+	pthread_mutex_unlock(&icmp_ratelimit_lock);
+
+	return allow;
+}
 
 /* send icmp packet
  * 
@@ -39,6 +124,20 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 	struct iphdr* iph = packet_to_ip_hdr(in_pkt);
 	char* in_ipdata = IP_DATA(iph);
 
+	// an error is sent from the iface on the way back to the source, and not
+	// at all if there is no route back
+	u32 saddr = ntohl(iph->daddr);
+	if (type == ICMP_PORT_UNREACH || type == ICMP_TIME_EXCEEDED) {
+		rcu_read_lock();
+		rt_entry_t *rt_entry = longest_prefix_match(ntohl(iph->saddr));
+		if (!rt_entry) {
+			rcu_read_unlock();
+			return;
+		}
+		saddr = rt_entry->iface->ip;
+		rcu_read_unlock();
+	}
+
 	char* out_pkt = NULL;
 
 	int out_len = 0;
@@ -54,22 +153,22 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 	}
 	out_len = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + icmp_len;
 
-	out_pkt = malloc(out_len);
+	out_pkt = packet_alloc(out_len);
+	if (!out_pkt)
+		return;
+
+	// the tokens of the rate limit are taken only now, when nothing can keep
+	// the error from being sent
+	if (type != ICMP_ECHOREPLY && !icmp_ratelimit_allow(ntohl(iph->saddr))) {
+		stats_inc(STATS_ICMP_SUPPRESSED);
+		packet_free(out_pkt);
+		return;
+	}
+
 	memset(out_pkt, 0, out_len);
 
 	struct iphdr* oph = packet_to_ip_hdr(out_pkt);
-
-	if (type == ICMP_ECHOREPLY) {
-		ip_init_hdr(oph, ntohl(iph->daddr), ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
-	}
-	else if (type == ICMP_PORT_UNREACH || type == ICMP_TIME_EXCEEDED) {
-		rt_entry_t *rt_entry = longest_prefix_match(ntohl(iph->saddr));
-		if (!rt_entry) {
-			free(out_pkt);
-			return;
-		}
-		ip_init_hdr(oph, rt_entry->iface->ip, ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
-	}
+	ip_init_hdr(oph, saddr, ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
 
 	char* out_ipdata = IP_DATA(oph);
 	struct icmphdr* out_icmp_hdr = (struct icmphdr*) out_ipdata;
@@ -87,9 +186,8 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 	out_icmp_hdr->code = code;
 	out_icmp_hdr->checksum = icmp_checksum(out_icmp_hdr, icmp_len);
 
-	if (out_pkt) {
-		ip_send_packet(out_pkt, out_len);
-	}
+	stats_inc(STATS_ICMP_SENT);
+	ip_send_packet(out_pkt, out_len);
 }
 
 void handle_icmp_packet(iface_info_t *iface, char *packet, int len) {
@@ -98,6 +196,7 @@ void handle_icmp_packet(iface_info_t *iface, char *packet, int len) {
 
 	if (icmp_header->type == ICMP_ECHOREQUEST) {
 		icmp_send_packet(packet, len, ICMP_ECHOREPLY, 0);
-		return;
 	}
+
+	packet_free(packet);
 }
@@ -27,5 +27,7 @@ struct ether_arp {
 void handle_arp_packet(iface_info_t *info, char *pkt, int len);
 void arp_send_request(iface_info_t *iface, u32 dst_ip);
 void iface_send_packet_by_arp(iface_info_t *iface, u32 dst_ip, char *pkt, int len);
+void iface_send_packet_to_mac(iface_info_t *iface, const u8 dst_mac[ETH_ALEN], char *pkt, int len);
+void iface_pend_packet_by_arp(iface_info_t *iface, u32 dst_ip, char *pkt, int len);
 
 #endif
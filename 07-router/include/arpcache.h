@@ -7,10 +7,21 @@
 
 #include <pthread.h>
 
-#define MAX_ARP_SIZE 32
+#define ARP_TABLE_INIT_SIZE 64		// slots of the table at first, a power of 2
 #define ARP_ENTRY_TIMEOUT 15
 #define ARP_REQUEST_MAX_RETRIES	5
 
+// the packets pending for arp replies are bounded: a request keeps at most
+// ARP_PENDING_MAX_PACKETS packets, the oldest one being dropped for a new one,
+// and a packet needing a new request is dropped if ARP_PENDING_MAX_REQUESTS
+// requests are pending already, so that a scan of a dead subnet takes bounded
+// memory. The requests are indexed by IP in a hash table of
+// ARP_REQ_HASH_SIZE buckets.
+#define ARP_PENDING_MAX_PACKETS		16
+#define ARP_PENDING_MAX_REQUESTS	1024
+#define ARP_REQ_HASH_BITS			8
+#define ARP_REQ_HASH_SIZE			(1 << ARP_REQ_HASH_BITS)
+
 struct cached_pkt {
 	struct list_head list;
 	char *packet;
@@ -19,10 +30,12 @@ struct cached_pkt {
 
 struct arp_req {
 	struct list_head list;
+	struct list_head hash_list;		// in the bucket of ip4
 	iface_info_t *iface;
 	u32 ip4;
 	time_t sent;
 	int retries;
+	int npackets;
 	struct list_head cached_packets;
 };
 
@@ -33,16 +46,33 @@ struct arp_cache_entry {
 	int valid;
 };
 
+// the IP->mac entries are kept in a hash table with open addressing (linear
+// probing), which grows twice as large when it gets half full. A table
+// replaced by a larger one is kept (in the retired list) until arpcache_destroy,
+// since a lookup may still be reading it; their sizes sum up to less than the
+// current one.
+typedef struct arp_table {
+	struct arp_table *retired;
+	u32 size;						// number of slots, a power of 2
+	u32 count;						// number of valid entries
+	struct arp_cache_entry entries[];
+} arp_table_t;
+
+// the table is changed with lock held, and read without it: a lookup reads
+// the table between two loads of seq, which is odd while the table is being
+// changed, and retries if seq has changed meanwhile (a seqlock)
 typedef struct {
-	struct arp_cache_entry entries[MAX_ARP_SIZE];
+	arp_table_t *table;
+	u32 seq;
 	struct list_head req_list;
+	struct list_head req_hash[ARP_REQ_HASH_SIZE];
+	int nreqs;
 	pthread_mutex_t lock;
-	pthread_t thread;
 } arpcache_t;
 
 void arpcache_init();
 void arpcache_destroy();
-void *arpcache_sweep(void *);
+void arpcache_sweep(void *arg);
 
 int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN]);
 void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN]);
@@ -3,10 +3,28 @@
 
 #include "types.h"
 
+// buffers of at least CHECKSUM_PARTIAL_MIN bytes are summed by
+// checksum_partial, with SIMD instructions where the cpu supports them (see
+// checksum.c); shorter ones, e.g. ip headers, are summed inline
+#define CHECKSUM_PARTIAL_MIN	64
+
+// the one's complement sum of the buffer, folded into 32 bits
+u32 checksum_partial(const void *buf, int nbytes);
+
 // calculate the checksum of the given buf, providing sum 
 // as the initial value
 static inline u16 checksum(u16 *ptr, int nbytes, u32 sum)
 {
+	if (nbytes >= CHECKSUM_PARTIAL_MIN) {
+		u64 total = (u64)sum + checksum_partial(ptr, nbytes);
+		total = (total >> 32) + (total & 0xffffffff);
+		sum = (total >> 32) + (total & 0xffffffff);
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum = sum + (sum >> 16);
+
+		return (u16)~sum;
+	}
+
 	if (nbytes % 2) {
 		sum += ((u8 *)ptr)[--nbytes];
 	}
@@ -22,4 +40,17 @@ static inline u16 checksum(u16 *ptr, int nbytes, u32 sum)
     return (u16)~sum;
 }
 
+// update the checksum csum after a 16-bit word covered by it changes from old
+// to new, without summing the whole buffer again: HC' = ~(~HC + ~m + m'), as
+// in RFC 1624 (eqn. 3). All the values are in network byte order.
+static inline u16 checksum_update(u16 csum, u16 old, u16 new)
+{
+	u32 sum = (u16)~csum + (u16)~old + new;
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = sum + (sum >> 16);
+
+	return (u16)~sum;
+}
+
 #endif
@@ -0,0 +1,60 @@
+#ifndef __FLOWCACHE_H__
+#define __FLOWCACHE_H__
+
+#include "base.h"
+#include "types.h"
+#include "ether.h"
+
+// destination cache of the forwarding path
+//
+// Each thread caches, for the destinations it forwarded to recently, the
+// egress iface and the mac of the next hop found by longest_prefix_match and
+// arpcache_lookup, so that forwarding to them again takes one probe into a
+// direct-mapped table. An entry is valid only while flow_cache_gen is the same
+// as when the lookups were done: the generation is increased whenever a route
+// is added or removed, or an IP->mac mapping is changed or removed. The
+// destinations of equal-cost routes are not cached, as their flows take
+// different paths.
+#define FLOW_CACHE_BITS	10
+#define FLOW_CACHE_SIZE	(1 << FLOW_CACHE_BITS)		// entries per thread
+
+typedef struct {
+	u32 daddr;				// in host byte order
+	u32 gen;				// 0 for an empty entry
+	iface_info_t *iface;
+	u8 dmac[ETH_ALEN];
+} flow_entry_t;
+
+extern u32 flow_cache_gen;
+extern __thread flow_entry_t flow_cache[FLOW_CACHE_SIZE];
+
+// the generation should be read before the lookups whose result is cached
+static inline u32 flow_cache_generation()
+{
+	return __atomic_load_n(&flow_cache_gen, __ATOMIC_ACQUIRE);
+}
+
+// called after the routes or the IP->mac mappings are changed
+static inline void flow_cache_invalidate()
+{
+	__atomic_add_fetch(&flow_cache_gen, 1, __ATOMIC_RELEASE);
+}
+
+static inline flow_entry_t *flow_cache_slot(u32 daddr)
+{
+	return &flow_cache[(daddr * 2654435769u) >> (32 - FLOW_CACHE_BITS)];
+}
+
+// lookup the entry of daddr, filled in generation gen
+static inline flow_entry_t *flow_cache_lookup(u32 daddr, u32 gen)
+{
+	flow_entry_t *flow = flow_cache_slot(daddr);
+	if (flow->gen == gen && flow->daddr == daddr)
+		return flow;
+
+	return NULL;
+}
+
+void flow_cache_fill(u32 daddr, u32 gen, iface_info_t *iface, u8 dmac[ETH_ALEN]);
+
+#endif
@@ -41,6 +41,23 @@ struct icmphdr {
 /* Codes for TIME_EXCEEDED. */
 #define ICMP_EXC_TTL            0       /* TTL count exceeded           */
 
+// icmp errors are rate limited by token buckets, as by linux: the errors sent
+// to each source get one token per ICMP_RATELIMIT_MS, up to
+// ICMP_RATELIMIT_BURST, and all the errors get ICMP_MSGS_PER_SEC tokens per
+// second, up to ICMP_MSGS_BURST. The buckets of the sources are kept by source
+// in a table of ICMP_RATELIMIT_SIZE entries, in sets of ICMP_RATELIMIT_WAYS
+// picked by the hash of the source, so that a source only loses its bucket
+// to others when they are all in use; a source taking the entry of another
+// one starts with the tokens refilled since its last use rather than a new
+// burst. Echo replies are not limited.
+#define ICMP_RATELIMIT_MS		1000
+#define ICMP_RATELIMIT_BURST	6
+#define ICMP_MSGS_PER_SEC		1000
+#define ICMP_MSGS_BURST			50
+#define ICMP_RATELIMIT_BITS		8
+#define ICMP_RATELIMIT_SIZE		(1 << ICMP_RATELIMIT_BITS)
+#define ICMP_RATELIMIT_WAYS		4
+
 static inline u16 icmp_checksum(struct icmphdr *icmp, int len)
 {
 	u16 tmp = icmp->checksum;
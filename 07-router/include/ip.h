@@ -12,6 +12,7 @@
 #include "arp.h"
 
 #include <netinet/in.h>
+#include <string.h>
 // #define IPPROTO_ICMP		1	// ICMP (Internet Control Message Protocol)
 // #define IPPROTO_TCP		6	// TCP (Transport Control Protocol)
 // #define IPPROTO_UDP		17	// UDP (User Datagram Protocol)
@@ -19,6 +20,8 @@
 
 // #include <netinet/ip.h>
 #define IP_DF	0x4000		// Do not Fragment
+#define IP_MF	0x2000		// More Fragments
+#define IP_OFFMASK	0x1fff	// mask of the fragment offset
 struct iphdr {
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     unsigned int ihl:4;
@@ -71,11 +74,61 @@ static inline u16 ip_checksum(struct iphdr *hdr)
 	return sum;
 }
 
+// check the checksum of the header: the sum over a valid header is 0xffff. The
+// length of the usual header without options is passed as a constant, so that
+// the compiler unrolls the sum.
+static inline int ip_checksum_valid(struct iphdr *hdr)
+{
+	if (hdr->ihl == 5)
+		return checksum((u16 *)hdr, IP_BASE_HDR_SIZE, 0) == 0;
+
+	return checksum((u16 *)hdr, hdr->ihl * 4, 0) == 0;
+}
+
+// decrease the ttl of the packet by 1, updating the checksum incrementally:
+// the ttl is the high byte of its 16-bit word, whose low byte (the protocol)
+// does not change
+static inline void ip_decrease_ttl(struct iphdr *hdr)
+{
+	u16 old = htons(hdr->ttl << 8);
+	hdr->ttl -= 1;
+	hdr->checksum = checksum_update(hdr->checksum, old, htons(hdr->ttl << 8));
+}
+
 static inline struct iphdr *packet_to_ip_hdr(const char *packet)
 {
 	return (struct iphdr *)(packet + ETHER_HDR_SIZE);
 }
 
+// the hash of the flow of the ip packet of len bytes, over its addresses,
+// protocol and, for tcp and udp, ports, which picks the path of the flow among
+// equal-cost routes. The ports are left out for the fragments, so that all the
+// fragments of a datagram take the same path.
+static inline u32 ip_flow_hash(struct iphdr *hdr, int len)
+{
+	u32 hash = hdr->saddr;
+	hash = hash * 0x9e3779b1 ^ hdr->daddr;
+	hash = hash * 0x9e3779b1 ^ hdr->protocol;
+
+	if ((hdr->protocol == IPPROTO_TCP || hdr->protocol == IPPROTO_UDP) && \
+			!(hdr->frag_off & htons(IP_MF | IP_OFFMASK)) && \
+			len >= IP_HDR_SIZE(hdr) + 4) {
+		u32 ports;
+		memcpy(&ports, IP_DATA(hdr), 4);
+		hash = hash * 0x9e3779b1 ^ ports;
+	}
+
+	// the finalizer of murmur3, so that every bit of the input reaches the
+	// high bits used by rt_select_nexthop
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
 void ip_init_hdr(struct iphdr *ip, u32 saddr, u32 daddr, u16 len, u8 proto);
 void handle_ip_packet(iface_info_t *iface, char *packet, int len);
 void ip_send_packet(char *packet, int len);
@@ -0,0 +1,24 @@
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include "types.h"
+#include "ether.h"
+
+// packets are allocated from a pool of fixed-size buffers, each one large
+// enough for an ethernet frame. Every thread keeps a freelist of its own, so
+// allocating and freeing a buffer takes no lock in the common case; buffers
+// are moved between the per-thread freelists and the shared one
+// PACKET_POOL_BATCH at a time, and a thread keeps at most PACKET_POOL_CACHE
+// free buffers.
+#define PACKET_POOL_BATCH	64
+#define PACKET_POOL_CACHE	256
+
+// allocate a packet of at most ETH_FRAME_LEN bytes, with one reference
+char *packet_alloc(int len);
+
+// take one more reference of the packet, it is recycled when the last
+// reference is dropped by packet_free
+void packet_hold(char *packet);
+void packet_free(char *packet);
+
+#endif
@@ -6,6 +6,12 @@
 
 #include "list.h"
 
+// a next hop of a route
+typedef struct {
+	u32 gw;					// ip address of next hop, 0 if on the link of iface
+	iface_info_t *iface;
+} rt_nexthop_t;
+
 // structure of ip forwarding table
 // note: 1, the table supports only ipv4 address;
 // 		 2, addresses are stored in host byte order.
@@ -16,13 +22,66 @@ typedef struct {
 	u32 gw;					// ip address of next hop (will be 0 if dest is in 
 							// the same network with iface)
 	int flags;				// flags (could be omitted here)
+	u32 metric;				// metric of the kernel route, the lower the preferred
+	u8 tos;					// tos of the kernel route
 	char if_name[16];		// name of the interface
 	iface_info_t *iface;	// pointer to the interface structure
+	struct list_head hash_list;	// in the index of the kernel routes, by key
+	struct list_head prefix_list;	// in the routes of its prefix
+	struct rt_prefix *prefix;	// the prefix of the route, in rtable
+	int nhops;				// the size of the next-hop group (in a snapshot)
+	rt_nexthop_t *nexthops;	// the group, laid out after the entry
 } rt_entry_t;
 
+// pick the next hop of the flow of hash (see ip_flow_hash) among the group of
+// the entry, mapping the hash onto [0, nhops) without a division
+static inline rt_nexthop_t *rt_select_nexthop(rt_entry_t *entry, u32 hash)
+{
+	return &entry->nexthops[((u64)hash * entry->nhops) >> 32];
+}
+
+// the routing table is indexed by a multibit trie: each node covers
+// RT_TRIE_STRIDE bits of the address, and a prefix whose length is not a
+// multiple of the stride is expanded into all the slots it covers in its node,
+// where the longest prefix is kept. A lookup walks at most 32 / RT_TRIE_STRIDE
+// nodes, whatever the number of routes. The trie is patched for the prefixes
+// changed whenever the table is updated, see rt_fib_t.
+#define RT_TRIE_STRIDE	4
+#define RT_TRIE_FANOUT	(1 << RT_TRIE_STRIDE)
+
+typedef struct rt_trie_node {
+	struct rt_trie_node *children[RT_TRIE_FANOUT];
+	rt_entry_t *entries[RT_TRIE_FANOUT];	// the longest prefix in each slot
+	u32 version;		// of the snapshot the node was made for
+} rt_trie_node_t;
+
+// the forwarding table: an immutable snapshot of rtable, made of a trie over
+// copies of its entries. The forwarding path looks up the current snapshot in
+// a read section of rcu, and the writers, serialized by rtable_update_begin()
+// and rtable_update_end(), make a new one and swap it in, freeing what only
+// the old one used after a grace period. So a lookup never waits, and sees the
+// table either before or after a whole update.
+//
+// A new snapshot shares the nodes and entries of the old one, but for those of
+// the prefixes changed by the update: their entries are copied again, and the
+// nodes on the way down to them are copied and patched. So an update costs as
+// much as the prefixes it changes, whatever the size of the table.
+//
+// The entries of the same prefix and the lowest metric are equal-cost paths:
+// they are merged into one entry of the trie, whose next hops are laid out
+// after it, and the forwarding path spreads the flows over them. The entries
+// of a higher metric are left out of the trie as fallbacks.
+typedef struct {
+	rt_trie_node_t *root;
+	rt_entry_t *def;		// the default route, of prefix length 0
+	u32 version;
+} rt_fib_t;
+
 extern struct list_head rtable;
 
 void init_rtable();
+void rtable_update_begin();
+void rtable_update_end();
 void load_static_rtable();
 void clear_rtable();
 void add_rt_entry(rt_entry_t *entry);
@@ -31,8 +90,12 @@ void print_rtable();
 void print_rtable_debug();
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface);
 
+// the entry returned is valid until the end of the read section of rcu in
+// which it was looked up
 rt_entry_t *longest_prefix_match(u32 ip);
+rt_entry_t *lookup_rt_trie(u32 ip);
 
+void subscribe_kernel_routes();
 void load_rtable_from_kernel();
 
 #endif
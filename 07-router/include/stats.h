@@ -0,0 +1,108 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "base.h"
+#include "types.h"
+
+#include <stdio.h>
+
+// counters of the data plane
+//
+// Each thread counts into a block of its own, aligned to cache lines so that
+// no two threads write to the same line, without any lock or atomic
+// read-modify-write. The blocks are summed when the counters are read, by
+// dump_stats or through the unix socket started by start_stats_server.
+#define CACHE_LINE_SIZE 64
+
+// the counters are served at this abstract unix socket, which belongs to the
+// network namespace of the router, e.g. read them in that namespace by
+// ``socat - ABSTRACT-CONNECT:router.stats''. A connection may send one request
+// line instead: ``trace on'', ``trace off'' or ``trace'' to dump the trace
+// rings (see trace.h).
+#define STATS_SOCK_NAME		"router.stats"
+
+// the counters are dumped if no request arrives in STATS_REQUEST_TIMEOUT ms
+#define STATS_REQUEST_TIMEOUT	100
+
+// only the first STATS_MAX_IFACES interfaces are counted
+#define STATS_MAX_IFACES	16
+
+enum stats_counter {
+	STATS_IP_FORWARD,		// ip packets forwarded to the next hop
+	STATS_IP_LOCAL,			// ip packets destined to the router
+	STATS_DROP_CHECKSUM,	// ip packets with a bad header checksum
+	STATS_DROP_TTL,			// ip packets whose ttl expired
+	STATS_DROP_NO_ROUTE,	// ip packets without any route
+	STATS_DROP_ETHER_TYPE,	// frames of unknown ether type
+	STATS_FLOW_HIT,			// ip packets forwarded by the flow cache, without
+							// looking up the routing table or arpcache
+	STATS_IP_MULTIPATH,		// ip packets forwarded by an equal-cost route
+	STATS_ARP_HIT,			// arpcache lookups found the mac
+	STATS_ARP_MISS,			// arpcache lookups did not
+	STATS_ARP_PENDING,		// packets pending for arp replies
+	STATS_ARP_DROP_QUEUE,	// pending packets dropped from a full queue
+	STATS_ARP_DROP_REQUEST,	// packets dropped, as too many requests pend
+	STATS_ARP_REQUEST,		// arp requests sent, including retries
+	STATS_ARP_UNREACHABLE,	// pending packets dropped, as no reply came
+	STATS_ICMP_SENT,		// icmp packets generated by the router
+	STATS_ICMP_SUPPRESSED,	// icmp errors not sent, as rate limited
+	STATS_NR_COUNTERS,
+};
+
+typedef struct {
+	u64 rx_frames;
+	u64 rx_bytes;
+	u64 tx_frames;
+	u64 tx_bytes;
+} stats_iface_t;
+
+typedef struct stats_block {
+	struct stats_block *next;	// the blocks of all the threads are linked
+	u64 counters[STATS_NR_COUNTERS];
+	stats_iface_t ifaces[STATS_MAX_IFACES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_block_t;
+
+extern __thread stats_block_t *stats_local;
+
+stats_block_t *stats_register();
+void dump_stats(FILE *fp);
+void start_stats_server();
+
+static inline stats_block_t *stats_block()
+{
+	return stats_local ? stats_local : stats_register();
+}
+
+// only this thread writes the counter, so a plain add is enough; the store is
+// relaxed atomic so that a reader never sees a torn value
+static inline void stats_add(u64 *counter, u64 n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(enum stats_counter counter)
+{
+	stats_add(&stats_block()->counters[counter], 1);
+}
+
+static inline void stats_iface_rx(iface_info_t *iface, int len)
+{
+	unsigned i = iface - instance->ifaces;
+	if (i < STATS_MAX_IFACES) {
+		stats_iface_t *stats = &stats_block()->ifaces[i];
+		stats_add(&stats->rx_frames, 1);
+		stats_add(&stats->rx_bytes, len);
+	}
+}
+
+static inline void stats_iface_tx(iface_info_t *iface, int len)
+{
+	unsigned i = iface - instance->ifaces;
+	if (i < STATS_MAX_IFACES) {
+		stats_iface_t *stats = &stats_block()->ifaces[i];
+		stats_add(&stats->tx_frames, 1);
+		stats_add(&stats->tx_bytes, len);
+	}
+}
+
+#endif
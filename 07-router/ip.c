@@ -1,4 +1,10 @@
 #include "ip.h"
+#include "arpcache.h"
+#include "flowcache.h"
+#include "packet.h"
+#include "rcu.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,59 +20,100 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 	struct iphdr* ip_header = packet_to_ip_hdr(packet);
 
 	// check checksum before modifying the packet
-	u16 ip_sum = checksum((u16 *)ip_header, ip_header->ihl * 4, 0);
-	if (ip_sum != 0) {
-		free(packet);
+	if (!ip_checksum_valid(ip_header)) {
+		stats_inc(STATS_DROP_CHECKSUM);
+		packet_free(packet);
 		return;
 	}
 
 	if (ip_header->daddr == iface->ip) {
+		stats_inc(STATS_IP_LOCAL);
 		if (ip_header->protocol == IPPROTO_ICMP) {
 			handle_icmp_packet(iface, packet, len);
+			return;
 		}
 		else {
 			// Sending a non-ICMP packet to a router is meaningless
-			free(packet);
+			packet_free(packet);
 			return;
 		}
 	}
 
-	// TTL -= 1
-	ip_header->ttl -= 1;
+	// TTL -= 1, and update the checksum for it
+	ip_decrease_ttl(ip_header);
 	if (ip_header->ttl <= 0) {
 		// ttl expired, send ICMP time exceeded
+		stats_inc(STATS_DROP_TTL);
 		icmp_send_packet(packet, len, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
-		free(packet);
+		packet_free(packet);
 		return;
 	}
 
-	// Recompute checksum
-	ip_header->checksum = ip_checksum(ip_header);
-
-	// Search in routing table
+	// Search in the destination cache first, which skips the lookups in the
+	// routing table and arpcache
 	u32 daddr = ntohl(ip_header->daddr);
+	u32 gen = flow_cache_generation();
+	flow_entry_t *flow = flow_cache_lookup(daddr, gen);
+	if (flow) {
+		trace(TRACE_LOOKUP, flow->iface, daddr, 0);
+		stats_inc(STATS_FLOW_HIT);
+		stats_inc(STATS_IP_FORWARD);
+		iface_send_packet_to_mac(flow->iface, flow->dmac, packet, len);
+		return;
+	}
+
+	// Search in routing table, and pick the path of the flow if the route has
+	// several; the next hop is copied out of the read section, as the ifaces
+	// are never freed
+	rcu_read_lock();
 	rt_entry_t* rt_entry = longest_prefix_match(daddr);
+	rt_nexthop_t *nh = NULL;
+	int multipath = 0;
+	if (rt_entry) {
+		multipath = rt_entry->nhops > 1;
+		nh = multipath ? rt_select_nexthop(rt_entry, \
+				ip_flow_hash(ip_header, len - ETHER_HDR_SIZE)) : rt_entry->nexthops;
+	}
+	iface_info_t *rt_iface = nh ? nh->iface : NULL;
+	u32 next_hop = nh ? (nh->gw ? nh->gw : daddr) : 0;
+	rcu_read_unlock();
+	trace(TRACE_LOOKUP, rt_iface, daddr, next_hop);
 
-	if (!rt_entry) {
+	if (!rt_iface) {
+		stats_inc(STATS_DROP_NO_ROUTE);
 		icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
-		free(packet);
+		packet_free(packet);
 		return;
 	}
 
 	// Send packet to next hop
-	u32 next_hop = rt_entry->gw ? rt_entry->gw : daddr;
-
-	if (daddr == rt_entry->iface->ip) { // 
+	if (daddr == rt_iface->ip) { // 
+		stats_inc(STATS_IP_LOCAL);
 		if (ip_header->protocol == IPPROTO_ICMP) {
-			handle_icmp_packet(rt_entry->iface, packet, len);
+			handle_icmp_packet(rt_iface, packet, len);
 			return;
 		}
 		else {
 			// Sending a non-ICMP packet to a router is meaningless
-			free(packet);
+			packet_free(packet);
 			return;
 		}
 	}
 
-	iface_send_packet_by_arp(rt_entry->iface, next_hop, packet, len);
+	stats_inc(STATS_IP_FORWARD);
+	if (multipath)
+		stats_inc(STATS_IP_MULTIPATH);
+
+	// the next hop is cached only when its mac address is known, and the
+	// route has one path: the cache, by destination, cannot tell the flows
+	// spread over several apart
+	u8 dst_mac[ETH_ALEN];
+	if (arpcache_lookup(next_hop, dst_mac)) {
+		if (!multipath)
+			flow_cache_fill(daddr, gen, rt_iface, dst_mac);
+		iface_send_packet_to_mac(rt_iface, dst_mac, packet, len);
+	}
+	else {
+		iface_pend_packet_by_arp(rt_iface, next_hop, packet, len);
+	}
 }
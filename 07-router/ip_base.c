@@ -3,6 +3,8 @@
 #include "arpcache.h"
 #include "rtable.h"
 #include "arp.h"
+#include "packet.h"
+#include "rcu.h"
 
 // #include "log.h"
 
@@ -28,23 +30,13 @@ void ip_init_hdr(struct iphdr *ip, u32 saddr, u32 daddr, u16 len, u8 proto)
 
 // lookup in the routing table, to find the entry with the same and longest prefix.
 // the input address is in host byte order
+//
+// The lookup is done in the trie of the current snapshot of rtable (see
+// rtable.h), instead of scanning all the entries, and must be done in a read
+// section of rcu.
 rt_entry_t *longest_prefix_match(u32 dst)
 {
-	// fprintf(stderr, "TODO: longest prefix match for the packet.\n");
-	u32 max_mask = 0;
-
-	rt_entry_t *entry = NULL;
-	rt_entry_t *result = NULL;
-
-	list_for_each_entry(entry, &rtable, list) {
-		if ((dst & entry->mask) == (entry->dest & entry->mask)) {
-			if (entry->mask >= max_mask) {
-				max_mask = entry->mask;
-				result = entry;
-			}
-		}
-	}
-	return result;
+	return lookup_rt_trie(dst);
 }
 
 // send IP packet
@@ -60,20 +52,27 @@ void ip_send_packet(char *packet, int len)
 	struct iphdr* iph = (struct iphdr*)(packet + sizeof(struct ether_header));
 
 	u32 daddr = ntohl(iph->daddr);
+
+	// the route is copied out of the read section, as the ifaces are never freed
+	rcu_read_lock();
 	rt_entry_t* d_entry = longest_prefix_match(daddr);
 
 
 	if (!d_entry) {
 		// No such route found in routing table
-		free(packet);
+		rcu_read_unlock();
+		packet_free(packet);
 		return;
 	}
 
-	u32 next_hop = d_entry->gw ? d_entry->gw : daddr;
+	rt_nexthop_t *nh = rt_select_nexthop(d_entry, ip_flow_hash(iph, len - ETHER_HDR_SIZE));
+	u32 next_hop = nh->gw ? nh->gw : daddr;
+	iface_info_t *iface = nh->iface;
+	rcu_read_unlock();
 
-	memcpy(eh->ether_dhost, d_entry->iface->mac, ETH_ALEN); // set dest addr in Ethernet header
+	memcpy(eh->ether_dhost, iface->mac, ETH_ALEN); // set dest addr in Ethernet header
 	eh->ether_type = htons(ETH_P_IP);
 
 
-	iface_send_packet_by_arp(d_entry->iface, next_hop, packet, len);	return;
+	iface_send_packet_by_arp(iface, next_hop, packet, len);	return;
 }
@@ -5,6 +5,9 @@
 #include "ip.h"
 #include "icmp.h"
 #include "rtable.h"
+#include "packet.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "log.h"
 
@@ -20,9 +23,11 @@
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
 	struct ether_header *eh = (struct ether_header *)packet;
+	stats_iface_rx(iface, len);
+	trace(TRACE_PACKET_IN, iface, len, 0);
 
-	// log(DEBUG, "got packet from %s, %d bytes, proto: 0x%04hx\n", 
-	// 		iface->name, len, ntohs(eh->ether_type));
+	log_debug("got packet from %s, %d bytes, proto: 0x%04hx", \
+			iface->name, len, ntohs(eh->ether_type));
 	switch (ntohs(eh->ether_type)) {
 		case ETH_P_IP:
 			handle_ip_packet(iface, packet, len);
@@ -33,57 +38,28 @@ void handle_packet(iface_info_t *iface, char *packet, int len)
 		default:
 			log(ERROR, "Unknown packet type 0x%04hx, ingore it.", \
 					ntohs(eh->ether_type));
+			stats_inc(STATS_DROP_ETHER_TYPE);
+			packet_free(packet);
 			break;
 	}
 }
 
 // run user stack, receive packet on each interface, and handle those packet
-// like normal TCP/IP stack
+// like normal TCP/IP stack; each worker waits for its own sockets
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	struct epoll_event events[USTACK_MAX_EVENTS];
+	int epfd = instance->epfds[ustack_worker_id()];
 
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = epoll_wait(epfd, events, USTACK_MAX_EVENTS, -1);
 		if (ready < 0) {
 			perror("Poll failed!");
 			break;
 		}
-		else if (ready == 0)
-			continue;
 
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, while we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					if (!iface)
-						continue;
-
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
-			}
-		}
+		for (int i = 0; i < ready; i++)
+			ustack_handle_event(&events[i]);
 	}
 }
 
@@ -99,8 +75,15 @@ int main(int argc, const char **argv)
 	arpcache_init();
 
 	init_rtable();
+	subscribe_kernel_routes();
 	load_rtable_from_kernel();
 
+	start_stats_server();
+
+	// the number of forwarding threads can be given as the first argument
+	int nworkers = argc > 1 ? atoi(argv[1]) : 1;
+	start_ustack_workers(nworkers, ustack_run);
+
 	ustack_run();
 
 	return 0;
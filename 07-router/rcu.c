@@ -0,0 +1,88 @@
+#include "rcu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+// the grace period starts from 1, so that 0 means out of any read section
+u64 rcu_gp_ctr = 1;
+int rcu_has_membarrier = 0;
+
+__thread rcu_reader_t *rcu_self;
+
+static rcu_reader_t *rcu_readers;		// all the registered readers
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// use membarrier() for the barrier of the readers if the kernel supports it
+__attribute__((constructor))
+static void rcu_init()
+{
+#ifdef __NR_membarrier
+	int cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+	if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) && \
+			syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0)
+		rcu_has_membarrier = 1;
+#endif
+}
+
+// run a full memory barrier on every running thread of the process, or only
+// on this one if the readers issue theirs
+static void rcu_writer_barrier()
+{
+#ifdef __NR_membarrier
+	if (rcu_has_membarrier) {
+		if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+			return;
+		perror("membarrier");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// the reader of a thread lives until the process exits, as the threads do
+rcu_reader_t *rcu_register_thread()
+{
+	rcu_reader_t *reader = malloc(sizeof(rcu_reader_t));
+	if (!reader) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(reader, 0, sizeof(rcu_reader_t));
+
+	pthread_mutex_lock(&rcu_lock);
+	reader->next = rcu_readers;
+	__atomic_store_n(&rcu_readers, reader, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rcu_lock);
+
+	rcu_self = reader;
+	return reader;
+}
+
+void synchronize_rcu()
+{
+	pthread_mutex_lock(&rcu_lock);
+
+	// the readers that saw nothing of the new version may go on with the old
+	// one, but are seen to be in a read section here
+	rcu_writer_barrier();
+
+	u64 gp = __atomic_add_fetch(&rcu_gp_ctr, 1, __ATOMIC_RELAXED);
+	for (rcu_reader_t *reader = rcu_readers; reader; reader = reader->next) {
+		while (1) {
+			u64 ctr = __atomic_load_n(&reader->ctr, __ATOMIC_ACQUIRE);
+			if (ctr == 0 || ctr >= gp)
+				break;
+			usleep(100);
+		}
+	}
+
+	// the reads of the old version are done before it is freed
+	rcu_writer_barrier();
+
+	pthread_mutex_unlock(&rcu_lock);
+}
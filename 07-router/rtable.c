@@ -1,15 +1,369 @@
 #include "rtable.h"
 #include "ip.h"
+#include "flowcache.h"
+#include "rcu.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 struct list_head rtable;
 
+static rt_fib_t *rt_fib;			// the current snapshot
+static u32 rt_fib_version;
+
+// the writers of rtable are serialized by the mutex, and the snapshot is
+// published when the outermost update ends
+static pthread_mutex_t rtable_mutex;
+static int rtable_update_depth;
+
+// the routes of rtable by prefix, and the entry heading their group in the
+// snapshot being made. The prefixes changed since the last snapshot are queued
+// in rt_dirty, to be patched into the next one.
+typedef struct rt_prefix {
+	struct list_head hash_list;		// in the index of the prefixes
+	struct list_head dirty_list;	// in rt_dirty, or empty
+	struct list_head routes;		// the entries of the prefix, in rtable order
+	u32 dest;						// masked by mask
+	u32 mask;
+	rt_entry_t *group;				// NULL if the prefix has no route
+} rt_prefix_t;
+
+#define RT_PREFIX_HASH_BITS 16
+#define RT_PREFIX_HASH_SIZE (1 << RT_PREFIX_HASH_BITS)
+
+static struct list_head rt_prefix_hash[RT_PREFIX_HASH_SIZE];
+static struct list_head rt_dirty;
+
+// what the old snapshot uses but the one being made does not, to be freed
+// after the grace period
+static void **rt_retired;
+static int rt_nretired, rt_retired_size;
+
+static struct list_head *rt_prefix_bucket(u32 dest, u32 mask)
+{
+	u32 h = dest ^ (mask >> 16) ^ ((u32)__builtin_popcount(mask) << 24);
+	return &rt_prefix_hash[(h * 2654435769u) >> (32 - RT_PREFIX_HASH_BITS)];
+}
+
+static rt_prefix_t *find_rt_prefix(u32 dest, u32 mask)
+{
+	rt_prefix_t *prefix = NULL;
+	list_for_each_entry(prefix, rt_prefix_bucket(dest, mask), hash_list) {
+		if (prefix->dest == dest && prefix->mask == mask)
+			return prefix;
+	}
+
+	return NULL;
+}
+
+static rt_prefix_t *get_rt_prefix(u32 dest, u32 mask)
+{
+	rt_prefix_t *prefix = find_rt_prefix(dest, mask);
+	if (prefix)
+		return prefix;
+
+	prefix = malloc(sizeof(rt_prefix_t));
+	if (!prefix) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	init_list_head(&prefix->dirty_list);
+	init_list_head(&prefix->routes);
+	prefix->dest = dest;
+	prefix->mask = mask;
+	prefix->group = NULL;
+	list_add_tail(&prefix->hash_list, rt_prefix_bucket(dest, mask));
+
+	return prefix;
+}
+
+// queue the prefix to be patched into the next snapshot
+static void touch_rt_prefix(rt_prefix_t *prefix)
+{
+	if (list_empty(&prefix->dirty_list))
+		list_add_tail(&prefix->dirty_list, &rt_dirty);
+}
+
+static void retire_rt_fib_object(void *obj)
+{
+	if (rt_nretired == rt_retired_size) {
+		rt_retired_size = rt_retired_size ? rt_retired_size * 2 : 64;
+		rt_retired = realloc(rt_retired, sizeof(void *) * rt_retired_size);
+		if (!rt_retired) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	rt_retired[rt_nretired++] = obj;
+}
+
+static rt_trie_node_t *new_rt_trie_node()
+{
+	rt_trie_node_t *node = malloc(sizeof(rt_trie_node_t));
+	if (!node) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(node, 0, sizeof(rt_trie_node_t));
+
+	return node;
+}
+
+// the node to be patched for the snapshot being made: the node itself if it
+// was made for this snapshot, or else a copy of it (an empty one for NULL), as
+// the nodes of a published snapshot never change
+static rt_trie_node_t *cow_rt_trie_node(rt_trie_node_t *node)
+{
+	if (node && node->version == rt_fib_version)
+		return node;
+
+	rt_trie_node_t *copy = new_rt_trie_node();
+	if (node) {
+		memcpy(copy, node, sizeof(rt_trie_node_t));
+		retire_rt_fib_object(node);
+	}
+	copy->version = rt_fib_version;
+
+	return copy;
+}
+
+static int rt_trie_node_empty(rt_trie_node_t *node)
+{
+	for (int i = 0; i < RT_TRIE_FANOUT; i++) {
+		if (node->entries[i] || node->children[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+// the index of the slot of ip in the node at depth bits
+static inline int rt_trie_index(u32 ip, int depth)
+{
+	return (ip >> (32 - depth - RT_TRIE_STRIDE)) & (RT_TRIE_FANOUT - 1);
+}
+
+// the routes of a prefix are ordered by metric, then by tos as the kernel
+// keys them, and those of the same metric and tos (e.g. the next hops of a
+// multipath route) are the equal-cost paths of the prefix
+static int rt_entry_cmp(rt_entry_t *a, rt_entry_t *b)
+{
+	if (a->metric != b->metric)
+		return a->metric < b->metric ? -1 : 1;
+	return (int)a->tos - (int)b->tos;
+}
+
+// make the entry heading the group of the prefix in the trie, NULL if it has
+// no route: a copy of the first of the routes of the lowest cost, followed by
+// the next hops of these routes, without the same path twice. The routes of a
+// higher cost are fallbacks, which stay in rtable and are used by the snapshot
+// made after the routes of the lower cost are removed.
+static rt_entry_t *new_rt_group(rt_prefix_t *prefix)
+{
+	rt_entry_t *head = NULL, *entry = NULL;
+	int n = 0;
+	list_for_each_entry(entry, &prefix->routes, prefix_list) {
+		if (!head || rt_entry_cmp(entry, head) < 0) {
+			head = entry;
+			n = 0;
+		}
+		if (rt_entry_cmp(entry, head) == 0)
+			n += 1;
+	}
+	if (!head)
+		return NULL;
+
+	rt_entry_t *group = malloc(sizeof(rt_entry_t) + sizeof(rt_nexthop_t) * n);
+	if (!group) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(group, head, sizeof(rt_entry_t));
+	init_list_head(&group->list);
+	init_list_head(&group->hash_list);
+	init_list_head(&group->prefix_list);
+	group->prefix = NULL;
+	group->nexthops = (rt_nexthop_t *)(group + 1);
+	group->nhops = 0;
+
+	list_for_each_entry(entry, &prefix->routes, prefix_list) {
+		if (rt_entry_cmp(entry, head) != 0)
+			continue;
+
+		int i = 0;
+		while (i < group->nhops && (group->nexthops[i].gw != entry->gw || \
+					group->nexthops[i].iface != entry->iface))
+			i++;
+		if (i < group->nhops)
+			continue;
+
+		group->nexthops[i].gw = entry->gw;
+		group->nexthops[i].iface = entry->iface;
+		group->nhops += 1;
+	}
+
+	return group;
+}
+
+// fill the slot idx of the node at depth on the way to dest with the longest
+// prefix covering it among those held by the node, whose lengths are from
+// depth + 1 to depth + RT_TRIE_STRIDE
+static void fill_rt_trie_slot(rt_trie_node_t *node, u32 dest, int depth, int idx)
+{
+	u32 ip = (dest & ~(0xffffffffu >> depth)) | \
+			 ((u32)idx << (32 - depth - RT_TRIE_STRIDE));
+
+	node->entries[idx] = NULL;
+	for (int plen = depth + RT_TRIE_STRIDE; plen > depth; plen--) {
+		u32 mask = 0xffffffffu << (32 - plen);
+		rt_prefix_t *prefix = find_rt_prefix(ip & mask, mask);
+		if (prefix && prefix->group) {
+			node->entries[idx] = prefix->group;
+			return;
+		}
+	}
+}
+
+// patch the prefix into the trie of fib: copy the nodes on the way down to the
+// node holding the last bits of the prefix, fill again the slots covered by
+// these bits, and drop the nodes left empty on the way back
+static void patch_rt_trie(rt_fib_t *fib, rt_prefix_t *prefix)
+{
+	int plen = __builtin_popcount(prefix->mask);
+	u32 dest = prefix->dest;
+
+	if (plen == 0) {
+		fib->def = prefix->group;
+		return;
+	}
+
+	rt_trie_node_t **links[32 / RT_TRIE_STRIDE];
+	rt_trie_node_t **link = &fib->root;
+	int depth = 0, n = 0;
+	while (1) {
+		// a prefix removed has no slot below a missing node
+		if (!*link && !prefix->group)
+			break;
+
+		*link = cow_rt_trie_node(*link);
+		links[n++] = link;
+		if (plen - depth <= RT_TRIE_STRIDE) {
+			int base = rt_trie_index(dest, depth);
+			int nslots = 1 << (RT_TRIE_STRIDE - (plen - depth));
+			for (int i = base; i < base + nslots; i++)
+				fill_rt_trie_slot(*link, dest, depth, i);
+			break;
+		}
+
+		link = &(*link)->children[rt_trie_index(dest, depth)];
+		depth += RT_TRIE_STRIDE;
+	}
+
+	// the nodes dropped were made for this snapshot, so no lookup has seen
+	// them; the root is kept even if empty
+	while (--n > 0 && rt_trie_node_empty(*links[n])) {
+		free(*links[n]);
+		*links[n] = NULL;
+	}
+}
+
+// make a snapshot from the current one with the prefixes changed patched in,
+// swap it in, and free what only the old one used when no lookup is using it
+static void publish_rt_fib()
+{
+	rt_fib_t *old = rt_fib;
+	if (old && list_empty(&rt_dirty))
+		return;
+
+	rt_fib_t *fib = malloc(sizeof(rt_fib_t));
+	if (!fib) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	fib->version = ++rt_fib_version;
+	fib->root = cow_rt_trie_node(old ? old->root : NULL);
+	fib->def = old ? old->def : NULL;
+
+	// the groups are all made first, as a slot is filled from the groups of
+	// all the prefixes covering it
+	rt_prefix_t *prefix = NULL, *q;
+	list_for_each_entry(prefix, &rt_dirty, dirty_list) {
+		if (prefix->group)
+			retire_rt_fib_object(prefix->group);
+		prefix->group = new_rt_group(prefix);
+	}
+
+	list_for_each_entry_safe(prefix, q, &rt_dirty, dirty_list) {
+		patch_rt_trie(fib, prefix);
+		list_delete_entry(&prefix->dirty_list);
+		init_list_head(&prefix->dirty_list);
+		if (list_empty(&prefix->routes)) {
+			list_delete_entry(&prefix->hash_list);
+			free(prefix);
+		}
+	}
+
+	rcu_assign_pointer(rt_fib, fib);
+	flow_cache_invalidate();
+
+	if (old) {
+		synchronize_rcu();
+		free(old);
+		for (int i = 0; i < rt_nretired; i++)
+			free(rt_retired[i]);
+		rt_nretired = 0;
+	}
+}
+
+// lookup the entry with the longest prefix matching ip (in host byte order):
+// the deeper a slot is, the longer its prefix, so the last entry met on the
+// way down is the longest match
+rt_entry_t *lookup_rt_trie(u32 ip)
+{
+	rt_fib_t *fib = rcu_dereference(rt_fib);
+	rt_entry_t *result = fib->def;
+	rt_trie_node_t *node = fib->root;
+
+	for (int depth = 0; node; depth += RT_TRIE_STRIDE) {
+		int idx = rt_trie_index(ip, depth);
+		if (node->entries[idx])
+			result = node->entries[idx];
+		node = node->children[idx];
+	}
+
+	return result;
+}
+
 void init_rtable()
 {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&rtable_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
 	init_list_head(&rtable);
+	init_list_head(&rt_dirty);
+	for (int i = 0; i < RT_PREFIX_HASH_SIZE; i++)
+		init_list_head(&rt_prefix_hash[i]);
+	publish_rt_fib();
+}
+
+// the changes made to rtable between the outermost begin and end are
+// published at once, e.g. when the whole table is reloaded
+void rtable_update_begin()
+{
+	pthread_mutex_lock(&rtable_mutex);
+	rtable_update_depth += 1;
+}
+
+void rtable_update_end()
+{
+	if (--rtable_update_depth == 0)
+		publish_rt_fib();
+	pthread_mutex_unlock(&rtable_mutex);
 }
 
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
@@ -18,6 +372,8 @@ rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
 	memset(entry, 0, sizeof(*entry));
 
 	init_list_head(&(entry->list));
+	init_list_head(&(entry->hash_list));
+	init_list_head(&(entry->prefix_list));
 	entry->dest = dest;
 	entry->mask = mask;
 	entry->gw = gw;
@@ -29,24 +385,37 @@ rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
 
 void add_rt_entry(rt_entry_t *entry)
 {
+	rtable_update_begin();
 	list_add_tail(&entry->list, &rtable);
+	entry->prefix = get_rt_prefix(entry->dest & entry->mask, entry->mask);
+	list_add_tail(&entry->prefix_list, &entry->prefix->routes);
+	touch_rt_prefix(entry->prefix);
+	rtable_update_end();
 }
 
-void remove_rt_entry(rt_entry_t *entry)
+static void free_rt_entry(rt_entry_t *entry)
 {
 	list_delete_entry(&entry->list);
+	list_delete_entry(&entry->hash_list);
+	list_delete_entry(&entry->prefix_list);
+	touch_rt_prefix(entry->prefix);
 	free(entry);
 }
 
+void remove_rt_entry(rt_entry_t *entry)
+{
+	rtable_update_begin();
+	free_rt_entry(entry);
+	rtable_update_end();
+}
+
 void clear_rtable()
 {
-	struct list_head *head = &rtable, *tmp;
-	while (head->next != head) {
-		tmp = head->next;
-		list_delete_entry(tmp);
-		rt_entry_t *entry = list_entry(tmp, rt_entry_t, list);
-		free(entry);
-	}
+	rtable_update_begin();
+	struct list_head *head = &rtable;
+	while (head->next != head)
+		free_rt_entry(list_entry(head->next, rt_entry_t, list));
+	rtable_update_end();
 }
 
 void print_rtable()
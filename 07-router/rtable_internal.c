@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <net/if.h>
 #include <net/route.h>
@@ -12,168 +13,406 @@
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
-#define ROUTE_BATCH_SIZE 10240
+// the size of the buffer receiving a batch of netlink messages: a dump is
+// parsed batch by batch as it is received, so it does not bound the size of
+// the routing table
+#define ROUTE_BATCH_SIZE 65536
+
+// the route changes received back to back are applied in one update of
+// rtable, of at most ROUTE_SYNC_BATCHES batches
+#define ROUTE_SYNC_BATCHES 256
+
+// the receive buffer of the subscription, large enough for a burst of changes
+#define ROUTE_SYNC_RCVBUF (4 << 20)
 
 // Structure for sending the request for routing table
 typedef struct {
 	struct nlmsghdr nlmsg_hdr;
 	struct rtmsg rt_msg;
-	char buf[ROUTE_BATCH_SIZE];
 } route_request;
 
-// XXX: All the functions in this file should be treated as a blackbox. You do not 
+// XXX: All the functions in this file should be treated as a blackbox. You do not
 // need to understand how it works, but only trust it will process like the function
 // name indicates.
 
-static void if_index_to_name(int if_index, char *if_name)
+static int open_route_socket()
 {
-	int fd = socket(AF_INET, SOCK_DGRAM, 0); 
+	int fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
 	if (fd == -1) {
-		perror("Create socket failed.");
+		perror("Create netlink socket failed.");
 		exit(-1);
 	}
 
-	struct ifreq ifr;
-	ifr.ifr_ifindex = if_index;
+	return fd;
+}
 
-	if (ioctl(fd, SIOCGIFNAME, &ifr, sizeof(ifr))) {
-		perror("Get interface name failed.");
-		exit(-1);
+// the next hops of a multipath route beyond ROUTE_MAX_PATHS are ignored
+#define ROUTE_MAX_PATHS 16
+
+// parse the next hops of a multipath route through the desired interfaces
+static int parse_multipath(struct rtattr *rtap, rt_nexthop_t *nhs)
+{
+	int n = 0;
+	struct rtnexthop *rtnh = (struct rtnexthop *)RTA_DATA(rtap);
+	int len = RTA_PAYLOAD(rtap);
+	for (; RTNH_OK(rtnh, len) && n < ROUTE_MAX_PATHS;
+			len -= RTNH_ALIGN(rtnh->rtnh_len), rtnh = RTNH_NEXT(rtnh)) {
+		u32 gw = 0;
+		struct rtattr *attr = RTNH_DATA(rtnh);
+		int attrlen = rtnh->rtnh_len - sizeof(struct rtnexthop);
+		for (; RTA_OK(attr, attrlen); attr = RTA_NEXT(attr, attrlen)) {
+			if (attr->rta_type == RTA_GATEWAY)
+				gw = ntohl(*(u32 *)RTA_DATA(attr));
+		}
+
+		iface_info_t *iface = index_to_iface(rtnh->rtnh_ifindex);
+		if (iface) {
+			nhs[n].gw = gw;
+			nhs[n].iface = iface;
+			n += 1;
+		}
 	}
 
-	strcpy(if_name, ifr.ifr_name);
+	return n;
 }
 
-static iface_info_t *if_name_to_iface(const char *if_name)
+// the kernel tells the routes of a prefix apart by their tos and metric, and
+// so does rtable
+typedef struct {
+	u32 dest;
+	u32 mask;
+	u32 metric;
+	u8 tos;
+} route_key_t;
+
+// parse the route in a RTM_NEWROUTE or RTM_DELROUTE message into its key and
+// next hops, of which a multipath route has several, and return the number of
+// the next hops through the desired interfaces, or -1 if it is not a route of
+// rtable
+static int parse_route_msg(struct nlmsghdr *nlp, route_key_t *key, rt_nexthop_t *nhs)
 {
-	iface_info_t *iface = NULL;
-	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (strcmp(iface->name, if_name) == 0)
-			return iface;
+	// get route entry header
+	struct rtmsg *rtp = (struct rtmsg *)NLMSG_DATA(nlp);
+	// we only care about the unicast routes of the tableId route table
+	if (rtp->rtm_family != AF_INET || rtp->rtm_table != 254 || \
+			rtp->rtm_type != RTN_UNICAST)
+		return -1;
+
+	key->dest = key->mask = key->metric = 0;
+	key->tos = rtp->rtm_tos;
+	u32 gw = 0;
+	int if_index = 0;
+	int multipath = 0, n = 0;
+
+	// iterate all the attributes of the route entry
+	struct rtattr *rtap = (struct rtattr *)RTM_RTA(rtp);
+	int rtl = RTM_PAYLOAD(nlp);
+	for (; RTA_OK(rtap, rtl); rtap = RTA_NEXT(rtap, rtl)) {
+		switch(rtap->rta_type) {
+			// destination IPv4 address
+			case RTA_DST:
+				key->dest = ntohl(*(u32 *)RTA_DATA(rtap));
+				key->mask = rtp->rtm_dst_len ? 0xFFFFFFFF << (32 - rtp->rtm_dst_len) : 0;
+				break;
+			case RTA_PRIORITY:
+				key->metric = *(u32 *)RTA_DATA(rtap);
+				break;
+			case RTA_GATEWAY:
+				gw = ntohl(*(u32 *)RTA_DATA(rtap));
+				break;
+			case RTA_OIF:
+				if_index = *((int *) RTA_DATA(rtap));
+				break;
+			case RTA_MULTIPATH:
+				multipath = 1;
+				n = parse_multipath(rtap, nhs);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (multipath)
+		return n;
+
+	// only the routes through the desired interfaces
+	nhs[0].gw = gw;
+	nhs[0].iface = index_to_iface(if_index);
+
+	return nhs[0].iface != NULL;
+}
+
+// the kernel routes in rtable are indexed by key, so that a change is applied
+// without scanning the table
+#define ROUTE_HASH_BITS 14
+#define ROUTE_HASH_SIZE (1 << ROUTE_HASH_BITS)
+
+static struct list_head route_hash[ROUTE_HASH_SIZE];
+
+static void init_route_hash()
+{
+	for (int i = 0; i < ROUTE_HASH_SIZE; i++)
+		init_list_head(&route_hash[i]);
+}
+
+static struct list_head *route_bucket(route_key_t *key)
+{
+	u32 h = key->dest ^ (key->mask >> 16) ^ (key->metric * 31) ^ ((u32)key->tos << 24);
+	return &route_hash[(h * 2654435769u) >> (32 - ROUTE_HASH_BITS)];
+}
+
+static int route_key_match(rt_entry_t *entry, route_key_t *key)
+{
+	return entry->dest == key->dest && entry->mask == key->mask && \
+		entry->metric == key->metric && entry->tos == key->tos;
+}
+
+static int nexthop_match(rt_entry_t *entry, rt_nexthop_t *nh)
+{
+	return entry->gw == nh->gw && entry->iface == nh->iface;
+}
+
+// remove the kernel routes of the key, or only those through one of the next
+// hops in nhs if given, and return the number of the routes removed
+static int remove_kernel_routes(route_key_t *key, rt_nexthop_t *nhs, int n)
+{
+	int removed = 0;
+	rt_entry_t *entry = NULL, *q;
+	list_for_each_entry_safe(entry, q, route_bucket(key), hash_list) {
+		if (!route_key_match(entry, key))
+			continue;
+
+		int i = 0;
+		while (nhs && i < n && !nexthop_match(entry, &nhs[i]))
+			i++;
+		if (nhs && i == n)
+			continue;
+
+		remove_rt_entry(entry);
+		removed += 1;
+	}
+
+	return removed;
+}
+
+static rt_entry_t *find_rt_entry(route_key_t *key, rt_nexthop_t *nh)
+{
+	rt_entry_t *entry = NULL;
+	list_for_each_entry(entry, route_bucket(key), hash_list) {
+		if (route_key_match(entry, key) && nexthop_match(entry, nh))
+			return entry;
 	}
 
-	fprintf(stderr, "Could not find the desired interface "
-			"according to if_name '%s'\n", if_name);
 	return NULL;
 }
 
-static int get_unparsed_route_info(char *buf, int size)
+// apply a route message of the kernel to rtable, in an update of it, with an
+// entry for each next hop of the route: a new route replaces the routes of the
+// same key only if the kernel replaced them (NLM_F_REPLACE), and is added along
+// otherwise; a removed route is removed through the next hops it has. Return
+// the number of the entries added or removed.
+static int apply_route_msg(struct nlmsghdr *nlp)
+{
+	if (nlp->nlmsg_type != RTM_NEWROUTE && nlp->nlmsg_type != RTM_DELROUTE)
+		return 0;
+
+	route_key_t key;
+	rt_nexthop_t nhs[ROUTE_MAX_PATHS];
+	int n = parse_route_msg(nlp, &key, nhs);
+	if (n < 0)
+		return 0;
+
+	if (nlp->nlmsg_type == RTM_DELROUTE)
+		return remove_kernel_routes(&key, nhs, n);
+
+	// the replaced routes go away even if the new one is not through the
+	// desired interfaces
+	int changed = 0;
+	if (nlp->nlmsg_flags & NLM_F_REPLACE)
+		changed += remove_kernel_routes(&key, NULL, 0);
+
+	for (int i = 0; i < n; i++) {
+		// a route may be both in a dump and in a change queued before it
+		if (find_rt_entry(&key, &nhs[i]))
+			continue;
+
+		rt_entry_t *entry = new_rt_entry(key.dest, key.mask, nhs[i].gw, nhs[i].iface);
+		entry->flags = RTF_UP;
+		if (entry->gw != 0)
+			entry->flags |= RTF_GATEWAY;
+		if (key.mask == (u32)(-1))
+			entry->flags |= RTF_HOST;
+		entry->metric = key.metric;
+		entry->tos = key.tos;
+
+		list_add_tail(&entry->hash_list, route_bucket(&key));
+		add_rt_entry(entry);
+		changed += 1;
+	}
+
+	return changed;
+}
+
+// dump the routes of the kernel into rtable, replacing all the routes in it,
+// and return the number of the routes loaded
+static int dump_kernel_routes()
 {
-	int fd = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE); 
+	int fd = open_route_socket();
 
-	route_request *req = (route_request *)malloc(sizeof(route_request));
-	bzero(req,sizeof(route_request));
-	req->nlmsg_hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-	req->nlmsg_hdr.nlmsg_type = RTM_GETROUTE;
-	req->nlmsg_hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	req->rt_msg.rtm_family = AF_INET;
-	req->rt_msg.rtm_table = 254; 
+	route_request req;
+	bzero(&req, sizeof(route_request));
+	req.nlmsg_hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nlmsg_hdr.nlmsg_type = RTM_GETROUTE;
+	req.nlmsg_hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.rt_msg.rtm_family = AF_INET;
+	req.rt_msg.rtm_table = 254;
 
-	if ((send(fd, req, sizeof(route_request), 0)) < 0) {
+	if ((send(fd, &req, req.nlmsg_hdr.nlmsg_len, 0)) < 0) {
 		perror("Send routing request failed.");
 		exit(-1);
 	}
 
-	int len = 0;
-	int left = size;
-	while (1) {
-		if (left < sizeof(struct nlmsghdr)) {
-			fprintf(stderr, "Routing table is larger than %d.\n", size);
-			exit(-1);
-		}
+	char *buf = malloc(ROUTE_BATCH_SIZE);
+	if (!buf) {
+		perror("malloc");
+		exit(-1);
+	}
 
-		int nbytes = recv(fd, buf + len, left, 0);
-		if (nbytes < 0) {
+	// the forwarding path sees the table reloaded as a whole
+	rtable_update_begin();
+	clear_rtable();
+	init_route_hash();
+
+	int n = 0, done = 0;
+	while (!done) {
+		int len = recv(fd, buf, ROUTE_BATCH_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
 			fprintf(stderr, "Receive routing info failed.\n");
 			break;
-		} else if (nbytes == 0) {
+		} else if (len == 0) {
 			fprintf(stdout, "EOF in netlink\n");
 			break;
 		}
 
-		struct nlmsghdr *nlp = (struct nlmsghdr*)(buf+len);
-		if (nlp->nlmsg_type == NLMSG_DONE) {
-			break;
-		} else if (nlp->nlmsg_type == NLMSG_ERROR) {
-			fprintf(stderr, "Error exists in netlink msg.\n");
-			exit(-1);
-		}
+		for (struct nlmsghdr *nlp = (struct nlmsghdr *)buf;
+				NLMSG_OK(nlp, len); nlp = NLMSG_NEXT(nlp, len)) {
+			if (nlp->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			} else if (nlp->nlmsg_type == NLMSG_ERROR) {
+				fprintf(stderr, "Error exists in netlink msg.\n");
+				exit(-1);
+			}
 
-		len += nbytes;
-		left -= nbytes;
+			n += apply_route_msg(nlp);
+		}
 	}
 
+	rtable_update_end();
+
+	free(buf);
 	close(fd);
 
-	return len;
+	return n;
 }
 
-static int parse_routing_info(char *buf, int len)
+// dump the whole table again after the kernel dropped some changes as the
+// subscription overran: the changes still queued are older than the dump and
+// would roll it back, so they are dropped first, and only those queued after
+// it are applied on top of it
+static void resync_kernel_routes(int fd, char *buf)
 {
-	int n = 0;
-	init_list_head(&rtable);
-
-	// Outer loop: Iterate all the NETLINK headers
-	for (struct nlmsghdr *nlp = (struct nlmsghdr *)buf;
-			NLMSG_OK(nlp, len); nlp = NLMSG_NEXT(nlp, len)) {
-		// get route entry header
-		struct rtmsg *rtp = (struct rtmsg *)NLMSG_DATA(nlp);
-		// we only care about the tableId route table
-		if (rtp->rtm_table != 254)
-			continue;
+	while (recv(fd, buf, ROUTE_BATCH_SIZE, MSG_DONTWAIT) >= 0 || \
+			errno == EINTR || errno == ENOBUFS)
+		;
+
+	int n = dump_kernel_routes();
+	fprintf(stdout, "Routing table of %d entries has been reloaded.\n", n);
+}
+
+// apply the route changes received on the subscription; if the kernel dropped
+// some of them as the socket overran, the whole table is dumped again
+static void *sync_kernel_routes_thread(void *arg)
+{
+	int fd = (long)arg;
 
-		u32 dest = 0, mask = 0, gw = 0;
-		int flags = 0;
-		char if_name[16];
-
-		// Inner loop: iterate all the attributes of one route entry
-		struct rtattr *rtap = (struct rtattr *)RTM_RTA(rtp);
-		int rtl = RTM_PAYLOAD(nlp);
-		for (; RTA_OK(rtap, rtl); rtap = RTA_NEXT(rtap, rtl)) {
-			switch(rtap->rta_type) {
-				// destination IPv4 address
-				case RTA_DST:
-					dest = ntohl(*(u32 *)RTA_DATA(rtap));
-					mask = 0xFFFFFFFF << (32 - rtp->rtm_dst_len);
-					break;
-				case RTA_GATEWAY:
-					gw = ntohl(*(u32 *)RTA_DATA(rtap));
-					break;
-				case RTA_PREFSRC:
-					// tmp_entry.addr = *(u32 *)RTA_DATA(rtap);
-					break;
-				case RTA_OIF:
-					if_index_to_name(*((int *) RTA_DATA(rtap)), if_name);
-					break;
-				default:
-					break;
+	char *buf = malloc(ROUTE_BATCH_SIZE);
+	if (!buf) {
+		perror("malloc");
+		exit(-1);
+	}
+
+	while (1) {
+		int len = recv(fd, buf, ROUTE_BATCH_SIZE, 0);
+		if (len < 0) {
+			if (errno == ENOBUFS)
+				resync_kernel_routes(fd, buf);
+			else if (errno != EINTR) {
+				perror("Receive route changes failed.");
+				break;
 			}
+			continue;
 		}
 
-		flags |= RTF_UP;
-		if (gw != 0)
-			flags |= RTF_GATEWAY;
-		if (mask == (u32)(-1))
-			flags |= RTF_HOST; 
-
-		iface_info_t *iface = if_name_to_iface(if_name);
-		if (iface) {
-			// the desired interface
-			rt_entry_t *entry = new_rt_entry(dest, mask, gw, iface);
-			add_rt_entry(entry);
+		// the changes pending in the socket are applied along, so that a burst
+		// of them is published at once
+		rtable_update_begin();
+		for (int i = 0; len > 0 && i < ROUTE_SYNC_BATCHES; i++) {
+			for (struct nlmsghdr *nlp = (struct nlmsghdr *)buf;
+					NLMSG_OK(nlp, len); nlp = NLMSG_NEXT(nlp, len))
+				apply_route_msg(nlp);
 
-			n += 1;
+			len = recv(fd, buf, ROUTE_BATCH_SIZE, MSG_DONTWAIT);
 		}
+		rtable_update_end();
+
+		if (len < 0 && errno == ENOBUFS)
+			resync_kernel_routes(fd, buf);
 	}
 
-	return n;
+	free(buf);
+	close(fd);
+
+	return NULL;
+}
+
+// subscribe to the changes of the kernel routes, and apply them to rtable as
+// they come; called before load_rtable_from_kernel(), so that no change made
+// after the dump is missed
+void subscribe_kernel_routes()
+{
+	init_route_hash();
+
+	int fd = open_route_socket();
+
+	int rcvbuf = ROUTE_SYNC_RCVBUF;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	struct sockaddr_nl addr;
+	bzero(&addr, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("Bind netlink socket failed.");
+		exit(-1);
+	}
+
+	int group = RTNLGRP_IPV4_ROUTE;
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+		perror("Subscribe to route changes failed.");
+		exit(-1);
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, sync_kernel_routes_thread, (void *)(long)fd);
+	pthread_detach(thread);
 }
 
 void load_rtable_from_kernel()
 {
-	char buf[ROUTE_BATCH_SIZE];
-	int len = get_unparsed_route_info(buf, ROUTE_BATCH_SIZE);
-	int n = parse_routing_info(buf, len);
+	int n = dump_kernel_routes();
 
 	fprintf(stdout, "Routing table of %d entries has been loaded.\n", n);
 }
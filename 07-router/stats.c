@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+static const char *stats_names[STATS_NR_COUNTERS] = {
+	[STATS_IP_FORWARD] = "ip_forward",
+	[STATS_IP_LOCAL] = "ip_local",
+	[STATS_DROP_CHECKSUM] = "drop_checksum",
+	[STATS_DROP_TTL] = "drop_ttl",
+	[STATS_DROP_NO_ROUTE] = "drop_no_route",
+	[STATS_DROP_ETHER_TYPE] = "drop_ether_type",
+	[STATS_FLOW_HIT] = "flow_hit",
+	[STATS_IP_MULTIPATH] = "ip_multipath",
+	[STATS_ARP_HIT] = "arp_hit",
+	[STATS_ARP_MISS] = "arp_miss",
+	[STATS_ARP_PENDING] = "arp_pending",
+	[STATS_ARP_DROP_QUEUE] = "arp_drop_queue",
+	[STATS_ARP_DROP_REQUEST] = "arp_drop_request",
+	[STATS_ARP_REQUEST] = "arp_request",
+	[STATS_ARP_UNREACHABLE] = "arp_unreachable",
+	[STATS_ICMP_SENT] = "icmp_sent",
+	[STATS_ICMP_SUPPRESSED] = "icmp_suppressed",
+};
+
+__thread stats_block_t *stats_local;
+
+// the blocks are never free'd, so that the counts of exited threads are kept
+static stats_block_t *stats_blocks;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// allocate the block of this thread, and link it for the readers
+stats_block_t *stats_register()
+{
+	stats_block_t *block = aligned_alloc(CACHE_LINE_SIZE, sizeof(stats_block_t));
+	if (!block) {
+		perror("aligned_alloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(block, 0, sizeof(stats_block_t));
+
+	pthread_mutex_lock(&stats_lock);
+	block->next = stats_blocks;
+	__atomic_store_n(&stats_blocks, block, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stats_lock);
+
+	stats_local = block;
+	return block;
+}
+
+static u64 stats_load(u64 *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// sum the counters of all the threads into sum
+static void sum_stats(stats_block_t *sum)
+{
+	memset(sum, 0, sizeof(stats_block_t));
+
+	stats_block_t *block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE);
+	for (; block; block = block->next) {
+		for (int i = 0; i < STATS_NR_COUNTERS; i++)
+			sum->counters[i] += stats_load(&block->counters[i]);
+
+		for (int i = 0; i < STATS_MAX_IFACES; i++) {
+			sum->ifaces[i].rx_frames += stats_load(&block->ifaces[i].rx_frames);
+			sum->ifaces[i].rx_bytes += stats_load(&block->ifaces[i].rx_bytes);
+			sum->ifaces[i].tx_frames += stats_load(&block->ifaces[i].tx_frames);
+			sum->ifaces[i].tx_bytes += stats_load(&block->ifaces[i].tx_bytes);
+		}
+	}
+}
+
+// dump the counters, one per line
+void dump_stats(FILE *fp)
+{
+	stats_block_t sum;
+	sum_stats(&sum);
+
+	for (int i = 0; i < STATS_NR_COUNTERS; i++)
+		fprintf(fp, "%s %llu\n", stats_names[i], (unsigned long long)sum.counters[i]);
+
+	for (int i = 0; i < instance->nifs && i < STATS_MAX_IFACES; i++) {
+		stats_iface_t *stats = &sum.ifaces[i];
+		fprintf(fp, "%s rx_frames %llu rx_bytes %llu tx_frames %llu tx_bytes %llu\n", \
+				instance->ifaces[i].name, \
+				(unsigned long long)stats->rx_frames, (unsigned long long)stats->rx_bytes, \
+				(unsigned long long)stats->tx_frames, (unsigned long long)stats->tx_bytes);
+	}
+}
+
+// handle the request of a connection, an empty one asks for the counters
+static void handle_stats_request(FILE *fp, char *req)
+{
+	req[strcspn(req, "\r\n")] = '\0';
+
+	if (strcmp(req, "") == 0 || strcmp(req, "stats") == 0) {
+		dump_stats(fp);
+	}
+	else if (strcmp(req, "trace on") == 0) {
+		set_trace_enabled(1);
+		fprintf(fp, "trace on\n");
+	}
+	else if (strcmp(req, "trace off") == 0) {
+		set_trace_enabled(0);
+		fprintf(fp, "trace off\n");
+	}
+	else if (strcmp(req, "trace") == 0) {
+		dump_trace(fp);
+	}
+	else {
+		fprintf(fp, "unknown request: %s\n", req);
+	}
+}
+
+// each connection to the socket gets the response to its request, and is
+// closed then
+static void *stats_server_thread(void *arg)
+{
+	int sd = (long)arg;
+
+	while (1) {
+		int fd = accept(sd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept() failed");
+			break;
+		}
+
+		// a reader sending nothing (nor closing its side) gets the counters
+		// after the timeout
+		struct timeval tv = { 0, STATS_REQUEST_TIMEOUT * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		char req[64] = "";
+		int n = recv(fd, req, sizeof(req) - 1, 0);
+		req[n > 0 ? n : 0] = '\0';
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *fp = open_memstream(&buf, &len);
+		if (fp) {
+			handle_stats_request(fp, req);
+			fclose(fp);
+			// the reader may have gone, which should not raise SIGPIPE
+			if (send(fd, buf, len, MSG_NOSIGNAL) < 0)
+				perror("send() failed");
+			free(buf);
+		}
+		close(fd);
+	}
+
+	close(sd);
+	return NULL;
+}
+
+void start_stats_server()
+{
+	int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		perror("socket() failed");
+		return;
+	}
+
+	// the name of an abstract socket starts with a null byte
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path + 1, STATS_SOCK_NAME);
+	socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(STATS_SOCK_NAME);
+
+	if (bind(sd, (struct sockaddr *)&addr, addrlen) < 0 || listen(sd, 8) < 0) {
+		log(ERROR, "could not serve the counters at @%s: %s", STATS_SOCK_NAME, \
+				strerror(errno));
+		close(sd);
+		return;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, stats_server_thread, (void *)(long)sd);
+}
@@ -7,11 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
 static arpcache_t arpcache;
 
-// initialize IP->mac mapping, request list, lock and sweeping thread
+// initialize IP->mac mapping, request list, lock and sweeping timer
 void arpcache_init()
 {
 	bzero(&arpcache, sizeof(arpcache_t));
@@ -20,7 +19,7 @@ void arpcache_init()
 
 	pthread_mutex_init(&arpcache.lock, NULL);
 
-	pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
+	ustack_add_timer(1000, arpcache_sweep, NULL);
 }
 
 // release all the resources when exiting
@@ -41,8 +40,6 @@ void arpcache_destroy()
 		free(req_entry);
 	}
 
-	pthread_kill(arpcache.thread, SIGTERM);
-
 	pthread_mutex_unlock(&arpcache.lock);
 }
 
@@ -175,7 +172,7 @@ void arpcache_insert(u32 ip4, u8 mac[])
 	pthread_mutex_unlock(&arpcache.lock);
 }
 
-// sweep arpcache periodically
+// sweep arpcache periodically, ustack_run calls it every second
 //
 // For the IP->mac entry, if the entry has been in the table for more than 15
 // seconds, remove it from the table.
@@ -184,58 +181,53 @@ void arpcache_insert(u32 ip4, u8 mac[])
 // request has been sent 5 times without receiving arp reply, for each
 // pending packet, send icmp packet (DEST_HOST_UNREACHABLE), and drop these
 // packets.
-void *arpcache_sweep(void *arg) 
+void arpcache_sweep(void *arg)
 {
-	while (1) {
-		sleep(1);
-		// fprintf(stderr, "TODO: sweep arpcache periodically: remove old entries, resend arp requests .\n");
-		pthread_mutex_lock(&arpcache.lock);
+	// fprintf(stderr, "TODO: sweep arpcache periodically: remove old entries, resend arp requests .\n");
+	pthread_mutex_lock(&arpcache.lock);
 
-		struct list_head unreachable_list;
-		init_list_head(&unreachable_list);
+	struct list_head unreachable_list;
+	init_list_head(&unreachable_list);
 
-		time_t now = time(NULL);
+	time_t now = time(NULL);
 
-		// IP->mac entries
-		for (int i = 0; i < MAX_ARP_SIZE; i++) {
-			if (arpcache.entries[i].valid &&
-				(now - arpcache.entries[i].added) > ARP_ENTRY_TIMEOUT) {
-				arpcache.entries[i].valid = 0;
-			}
+	// IP->mac entries
+	for (int i = 0; i < MAX_ARP_SIZE; i++) {
+		if (arpcache.entries[i].valid &&
+			(now - arpcache.entries[i].added) > ARP_ENTRY_TIMEOUT) {
+			arpcache.entries[i].valid = 0;
 		}
+	}
 
-		// Pending packets
-		struct arp_req *req_entry = NULL, *req_q;
-		list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
-			if ((now - req_entry->sent) >= 1) {
-				if (req_entry->retries >= ARP_REQUEST_MAX_RETRIES) {
-					list_delete_entry(&(req_entry->list));
-					list_add_tail(&(req_entry->list), &unreachable_list);
-				}
-				else {
-					// Resend ARP request
-					arp_send_request(req_entry->iface, req_entry->ip4);
-					req_entry->sent = now;
-					req_entry->retries += 1;
-				}
+	// Pending packets
+	struct arp_req *req_entry = NULL, *req_q;
+	list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
+		if ((now - req_entry->sent) >= 1) {
+			if (req_entry->retries >= ARP_REQUEST_MAX_RETRIES) {
+				list_delete_entry(&(req_entry->list));
+				list_add_tail(&(req_entry->list), &unreachable_list);
+			}
+			else {
+				// Resend ARP request
+				arp_send_request(req_entry->iface, req_entry->ip4);
+				req_entry->sent = now;
+				req_entry->retries += 1;
 			}
 		}
+	}
 
-		pthread_mutex_unlock(&arpcache.lock);
+	pthread_mutex_unlock(&arpcache.lock);
 
-		// Send ICMP DEST_HOST_UNREACHABLE for unreachable packets
-		struct arp_req *unreq_entry = NULL, *unreq_q;
-		list_for_each_entry_safe(unreq_entry, unreq_q, &unreachable_list, list) {
-			struct cached_pkt *pkt_entry = NULL, *pkt_q;
-			list_for_each_entry_safe(pkt_entry, pkt_q, &(unreq_entry->cached_packets), list) {
-				icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-				list_delete_entry(&(pkt_entry->list));
-				free(pkt_entry);
-			}
-			list_delete_entry(&(unreq_entry->list));
-			free(unreq_entry);
+	// Send ICMP DEST_HOST_UNREACHABLE for unreachable packets
+	struct arp_req *unreq_entry = NULL, *unreq_q;
+	list_for_each_entry_safe(unreq_entry, unreq_q, &unreachable_list, list) {
+		struct cached_pkt *pkt_entry = NULL, *pkt_q;
+		list_for_each_entry_safe(pkt_entry, pkt_q, &(unreq_entry->cached_packets), list) {
+			icmp_send_packet(pkt_entry->packet, pkt_entry->len, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
+			list_delete_entry(&(pkt_entry->list));
+			free(pkt_entry);
 		}
+		list_delete_entry(&(unreq_entry->list));
+		free(unreq_entry);
 	}
-
-	return NULL;
 }
@@ -0,0 +1,125 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+// The internet checksum is the one's complement sum of 16-bit words, and
+// 2^16 = 1 (mod 0xffff), so the words may be summed in any wider unit (with the
+// carries added back) and folded into 16 bits at last. The words are summed 8
+// bytes at a time in scalar code, and 16 or 32 bytes at a time with SSE2 or
+// AVX2, which is picked at startup according to the cpu.
+
+// add b to a in one's complement arithmetic, i.e. with the end-around carry
+static inline u64 add_carry64(u64 a, u64 b)
+{
+	a += b;
+	return a + (a < b);
+}
+
+// fold the 64-bit sum into 32 bits
+static inline u32 fold64(u64 sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	return (u32)sum;
+}
+
+// sum the remaining bytes, less than 8, of the buffer
+static inline u64 checksum_tail(const u8 *buf, int nbytes)
+{
+	u64 sum = 0;
+	for (; nbytes >= 2; buf += 2, nbytes -= 2) {
+		u16 word;
+		memcpy(&word, buf, 2);
+		sum += word;
+	}
+
+	// the odd byte is the first byte of a word padded with zero
+	if (nbytes) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		sum += buf[0];
+#else
+		sum += buf[0] << 8;
+#endif
+	}
+
+	return sum;
+}
+
+static u32 checksum_partial_scalar(const u8 *buf, int nbytes)
+{
+	u64 sum = 0;
+	for (; nbytes >= 8; buf += 8, nbytes -= 8) {
+		u64 word;
+		memcpy(&word, buf, 8);
+		sum = add_carry64(sum, word);
+	}
+
+	return fold64(add_carry64(sum, checksum_tail(buf, nbytes)));
+}
+
+#ifdef CHECKSUM_X86
+// each 32-bit word is widened into a 64-bit lane, which cannot overflow for any
+// buffer shorter than 2^32 words
+static u32 checksum_partial_sse2(const u8 *buf, int nbytes)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+
+	for (; nbytes >= 16; buf += 16, nbytes -= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)buf);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+
+	u64 lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	u64 sum = add_carry64(lanes[0], lanes[1]);
+
+	return fold64(add_carry64(sum, checksum_partial_scalar(buf, nbytes)));
+}
+
+__attribute__((target("avx2")))
+static u32 checksum_partial_avx2(const u8 *buf, int nbytes)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+
+	for (; nbytes >= 32; buf += 32, nbytes -= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)buf);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+
+	u64 lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	u64 sum = add_carry64(add_carry64(lanes[0], lanes[1]), \
+			add_carry64(lanes[2], lanes[3]));
+
+	return fold64(add_carry64(sum, checksum_partial_scalar(buf, nbytes)));
+}
+#endif
+
+static u32 (*checksum_partial_impl)(const u8 *buf, int nbytes) = checksum_partial_scalar;
+
+// pick the widest implementation supported by the cpu
+__attribute__((constructor))
+static void checksum_init()
+{
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		checksum_partial_impl = checksum_partial_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		checksum_partial_impl = checksum_partial_sse2;
+#endif
+}
+
+u32 checksum_partial(const void *buf, int nbytes)
+{
+	return checksum_partial_impl(buf, nbytes);
+}
@@ -3,6 +3,7 @@
 #include "rtable.h"
 #include "arp.h"
 #include "base.h"
+#include "rcu.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -63,16 +64,17 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 		ip_init_hdr(oph, ntohl(iph->daddr), ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
 	}
 	else if (type == ICMP_PORT_UNREACH || type == ICMP_TIME_EXCEEDED) {
-		pthread_mutex_lock(&rtable_mutex);
+		rcu_read_lock();
 
 		rt_entry_t *rt_entry = longest_prefix_match(ntohl(iph->saddr));
 		if (!rt_entry) {
+			rcu_read_unlock();
 			free(out_pkt);
-			pthread_mutex_unlock(&rtable_mutex);
 			return;
 		}
-		ip_init_hdr(oph, rt_entry->iface->ip, ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
-		pthread_mutex_unlock(&rtable_mutex);
+		u32 saddr = rt_entry->iface->ip;
+		rcu_read_unlock();
+		ip_init_hdr(oph, saddr, ntohl(iph->saddr), IP_BASE_HDR_SIZE + icmp_len, IPPROTO_ICMP);
 	}
 
 	char* out_ipdata = IP_DATA(oph);
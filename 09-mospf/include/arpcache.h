@@ -39,7 +39,6 @@ typedef struct {
 	struct arp_cache_entry entries[MAX_ARP_SIZE];	// IP->max mapping entries
 	struct list_head req_list;			// the pending packet list
 	pthread_mutex_t lock;				// each operation on arp cache should apply the lock first
-	pthread_t thread;					// the id of the arp cache sweeping thread
 } arpcache_t;
 
 void arpcache_init();
@@ -48,6 +47,6 @@ void arpcache_destroy();
 int arpcache_lookup(u32 ip4, u8 mac[]);
 void arpcache_insert(u32 ip4, u8 mac[]);
 void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len);
-void *arpcache_sweep(void *arg);
+void arpcache_sweep(void *arg);
 
 #endif
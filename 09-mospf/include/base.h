@@ -10,6 +10,7 @@
 
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <ifaddrs.h>
 
 #include <netinet/in.h>
@@ -26,22 +27,23 @@
 
 #define DYNAMIC_ROUTING
 
-typedef struct {
-	struct list_head iface_list;	// the list of interfaces
-	int nifs;						// number of interfaces
-	struct pollfd *fds;				// structure used to poll packets among 
-								    // all the interfaces
+// receive and send packets through the TPACKET_V3 rings shared with the
+// kernel, comment it out to use recvmmsg & sendmmsg instead
+#define USTACK_PACKET_MMAP
 
-#ifdef DYNAMIC_ROUTING
-	// used for mospf routing
-	u32 area_id;	
-	u32 router_id;
-	u16 sequence_num;
-	int lsuint;
-#endif
-} ustack_t;
+// without the packet rings, receive up to USTACK_RX_BATCH frames by one
+// recvmmsg(), and queue up to USTACK_TX_BATCH frames sent meanwhile to send
+// them by one sendmmsg() per interface; set both to 1 to handle one frame per
+// system call
+#define USTACK_RX_BATCH		32
+#define USTACK_TX_BATCH		64
 
-extern ustack_t *instance;
+// ustack_run waits for the interfaces and timers by epoll, and drains each
+// ready interface until no frame is pending, or USTACK_RX_BUDGET frames are
+// received so that other interfaces are not starved
+#define USTACK_RX_BUDGET	256
+#define USTACK_MAX_EVENTS	64
+#define USTACK_MAX_TIMERS	8
 
 typedef struct {
 	struct list_head list;		// list node used to link all interfaces
@@ -54,6 +56,8 @@ typedef struct {
 	char name[16];				// name of this interface
 	char ip_str[16];			// readable IP address
 
+	struct packet_ring *ring;	// rx & tx rings of fd, NULL if not mapped
+
 #ifdef DYNAMIC_ROUTING
 	// list of mospf neighbors
 	int helloint;
@@ -62,7 +66,38 @@ typedef struct {
 #endif
 } iface_info_t;
 
+typedef struct {
+	struct list_head iface_list;	// the list of interfaces
+	int nifs;						// number of interfaces
+	iface_info_t *ifaces;			// all the interfaces in one array
+	iface_info_t **fd_ifaces;		// interfaces indexed by fd
+	int max_fd;
+	iface_info_t **index_ifaces;	// interfaces indexed by ifindex
+	int max_index;
+	int epfd;						// epoll instance waiting for all the
+									// interfaces and timers
+
+#ifdef DYNAMIC_ROUTING
+	// used for mospf routing
+	u32 area_id;	
+	u32 router_id;
+	u16 sequence_num;
+	int lsuint;
+#endif
+} ustack_t;
+
+extern ustack_t *instance;
+
 void init_ustack();
 iface_info_t *fd_to_iface(int fd);
+iface_info_t *index_to_iface(int index);
+int iface_recv_packets(iface_info_t *iface, int budget);
 void iface_send_packet(iface_info_t *iface, const char *packet, int len);
+
+typedef void (*ustack_timer_handler)(void *arg);
+int ustack_add_timer(int interval_ms, ustack_timer_handler func, void *arg);
+int ustack_handle_event(struct epoll_event *ev);
+
+void handle_packet(iface_info_t *iface, char *packet, int len);
+
 #endif
@@ -81,6 +81,16 @@ static inline u16 ip_checksum(struct iphdr *hdr)
 	return sum;
 }
 
+// decrease the ttl of the packet by 1, updating the checksum incrementally:
+// the ttl is the high byte of its 16-bit word, whose low byte (the protocol)
+// does not change
+static inline void ip_decrease_ttl(struct iphdr *hdr)
+{
+	u16 old = htons(hdr->ttl << 8);
+	hdr->ttl -= 1;
+	hdr->checksum = checksum_update(hdr->checksum, old, htons(hdr->ttl << 8));
+}
+
 static inline struct iphdr *packet_to_ip_hdr(const char *packet)
 {
 	return (struct iphdr *)(packet + ETHER_HDR_SIZE);
@@ -0,0 +1,69 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include "types.h"
+
+// read-copy-update, for the data read on the forwarding path
+//
+// A reader brackets its accesses with rcu_read_lock() and rcu_read_unlock(),
+// which neither take a lock nor wait, and loads the shared pointer with
+// rcu_dereference(). A writer publishes a new version with rcu_assign_pointer()
+// and calls synchronize_rcu() before freeing the old one, which returns after
+// every read section that might still see the old version has ended.
+//
+// Each thread records the grace period in which its read section began (0 out
+// of any section), and synchronize_rcu() starts a new period and waits for the
+// readers still in an older one. The barrier that orders the record before
+// the reads is issued by the writer through membarrier() where the kernel
+// supports it, so that the readers only need a compiler barrier.
+
+typedef struct rcu_reader {
+	struct rcu_reader *next;
+	u64 ctr;				// the grace period of the section, 0 if out of it
+	int nesting;
+} rcu_reader_t;
+
+extern u64 rcu_gp_ctr;
+extern int rcu_has_membarrier;
+extern __thread rcu_reader_t *rcu_self;
+
+rcu_reader_t *rcu_register_thread();
+
+// must not be called in a read section, which would wait for itself
+void synchronize_rcu();
+
+static inline void rcu_reader_barrier()
+{
+	if (rcu_has_membarrier)
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	else
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_lock()
+{
+	rcu_reader_t *reader = rcu_self;
+	if (!reader)
+		reader = rcu_register_thread();
+
+	if (reader->nesting++ == 0) {
+		__atomic_store_n(&reader->ctr, \
+				__atomic_load_n(&rcu_gp_ctr, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		rcu_reader_barrier();
+	}
+}
+
+static inline void rcu_read_unlock()
+{
+	rcu_reader_t *reader = rcu_self;
+
+	if (--reader->nesting == 0) {
+		rcu_reader_barrier();
+		__atomic_store_n(&reader->ctr, 0, __ATOMIC_RELEASE);
+	}
+}
+
+#define rcu_dereference(p)			__atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#endif
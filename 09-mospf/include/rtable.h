@@ -7,6 +7,7 @@
 #include "list.h"
 
 #include <pthread.h>
+#include <net/route.h>
 
 // structure of ip forwarding table
 // note: 1, the table supports only ipv4 address;
@@ -17,25 +18,47 @@ typedef struct {
 	u32 mask;				// network mask of dest
 	u32 gw;					// ip address of next hop (will be 0 if dest is in 
 							// the same network with iface)
-	int flags;				// flags (could be omitted here)
+	int flags;				// flags, RTF_DYNAMIC for the routes computed by mospf
+	u32 metric;				// metric of the kernel route, the lower the preferred
+	u8 tos;					// tos of the kernel route
 	char if_name[16];		// name of the interface
 	iface_info_t *iface;	// pointer to the interface structure
+	struct list_head hash_list;	// in the index of the kernel routes, by key
 } rt_entry_t;
 
+// the forwarding table: an immutable snapshot of rtable, holding copies of its
+// entries. The forwarding path looks up the current snapshot in a read section
+// of rcu, and the writers, serialized by rtable_update_begin() and
+// rtable_update_end(), build a new one from rtable and swap it in, freeing the
+// old one after a grace period, unless the routes are left as they were. So a
+// lookup never waits, and never sees the table half cleared while it is
+// recomputed from the database.
+typedef struct {
+	rt_entry_t *entries;	// the copies of the entries
+	int nentries;
+	u32 version;
+} rt_fib_t;
+
 extern struct list_head rtable;
-extern pthread_mutex_t rtable_mutex;
+extern rt_fib_t *rt_fib;
 
 void init_rtable();
+void rtable_update_begin();
+void rtable_update_end();
 void load_static_rtable();
 void clear_rtable();
+void clear_dynamic_rtable();
 void add_rt_entry(rt_entry_t *entry);
 void remove_rt_entry(rt_entry_t *entry);
 void print_rtable();
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface);
 void try_add_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface);
+// the entry returned is valid until the end of the read section of rcu in
+// which it was looked up
 rt_entry_t *longest_prefix_match(u32 ip);
 u32 get_next_hop(rt_entry_t *entry, u32 dst);
 
+void subscribe_kernel_routes();
 void load_rtable_from_kernel();
 
 #endif
@@ -57,11 +57,8 @@ void ip_forward_packet(u32 dst, char *packet, int len)
 		free(packet);
 		return;
 	}
-	ip->ttl -= 1;
-
-	// recompute checksum
-	ip->checksum = 0;
-	ip->checksum = ip_checksum(ip);
+	// the checksum is updated for the new ttl only
+	ip_decrease_ttl(ip);
 
 	ip_send_packet(packet, len);
 }
@@ -3,6 +3,7 @@
 #include "arpcache.h"
 #include "rtable.h"
 #include "arp.h"
+#include "rcu.h"
 
 #include "log.h"
 
@@ -28,17 +29,25 @@ void ip_init_hdr(struct iphdr *ip, u32 saddr, u32 daddr, u16 len, u8 proto)
 
 // lookup in the routing table, to find the entry with the same and longest prefix.
 // the input address is in host byte order
+//
+// The lookup scans the current snapshot of rtable (see rtable.h), and must be
+// done in a read section of rcu.
 rt_entry_t *longest_prefix_match(u32 dst)
 {
 	// fprintf(stderr, "TODO: longest prefix match for the packet.\n");
 	u32 max_mask = 0;
 
-	rt_entry_t *entry = NULL;
+	rt_fib_t *fib = rcu_dereference(rt_fib);
 	rt_entry_t *result = NULL;
 
-	list_for_each_entry(entry, &rtable, list) {
+	for (int i = 0; i < fib->nentries; i++) {
+		rt_entry_t *entry = &fib->entries[i];
 		if ((dst & entry->mask) == (entry->dest & entry->mask)) {
-			if (entry->mask >= max_mask) {
+			// of the same prefix, a route of mospf (which comes later) wins
+			// over the kernel routes, and the kernel route of the lowest
+			// metric over the others
+			if (!result || entry->mask > max_mask || (entry->mask == max_mask && \
+					((entry->flags & RTF_DYNAMIC) || entry->metric < result->metric))) {
 				max_mask = entry->mask;
 				result = entry;
 			}
@@ -61,23 +70,25 @@ void ip_send_packet(char *packet, int len)
 
 	u32 daddr = ntohl(iph->daddr);
 
-	pthread_mutex_lock(&rtable_mutex);
+	// the route is copied out of the read section, as the ifaces are never freed
+	rcu_read_lock();
 	rt_entry_t* d_entry = longest_prefix_match(daddr);
 
 	if (!d_entry) {
 		// No such route found in routing table
+		rcu_read_unlock();
 		free(packet);
-		pthread_mutex_unlock(&rtable_mutex);
 		return;
 	}
 
 	u32 next_hop = d_entry->gw ? d_entry->gw : daddr;
+	iface_info_t *iface = d_entry->iface;
+	rcu_read_unlock();
 
-	memcpy(eh->ether_dhost, d_entry->iface->mac, ETH_ALEN); // set dest addr in Ethernet header
+	memcpy(eh->ether_dhost, iface->mac, ETH_ALEN); // set dest addr in Ethernet header
 	eh->ether_type = htons(ETH_P_IP);
 
 
-	iface_send_packet_by_arp(d_entry->iface, next_hop, packet, len);
-	pthread_mutex_unlock(&rtable_mutex);
+	iface_send_packet_by_arp(iface, next_hop, packet, len);
 	return;
 }
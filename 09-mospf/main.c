@@ -39,47 +39,19 @@ void handle_packet(iface_info_t *iface, char *packet, int len)
 // like normal TCP/IP stack
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	struct epoll_event events[USTACK_MAX_EVENTS];
 
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		int ready = epoll_wait(instance->epfd, events, USTACK_MAX_EVENTS, -1);
 		if (ready < 0) {
 			perror("Poll failed!");
 			break;
 		}
-		else if (ready == 0)
-			continue;
 
 		int received_data = 0;
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, while we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					received_data = 1;
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
-			}
+		for (int i = 0; i < ready; i++) {
+			if (ustack_handle_event(&events[i]) > 0)
+				received_data = 1;
 		}
 
 		if (!received_data)
@@ -99,6 +71,7 @@ int main(int argc, const char **argv)
 	arpcache_init();
 
 	init_rtable();
+	subscribe_kernel_routes();
 	load_rtable_from_kernel();
 
 	mospf_init();
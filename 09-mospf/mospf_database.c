@@ -247,18 +247,19 @@ void update_routing_table_from_database()
 
 	dijkstra(src_index);  // Calculate shortest paths
 
-	// Update routing table based on shortest paths
-	pthread_mutex_lock(&rtable_mutex);
+	// Update routing table based on shortest paths, which is published to the
+	// forwarding path as a whole at the end
+	rtable_update_begin();
 
-	clear_rtable();
-	
-	load_rtable_from_kernel();
+	// the kernel routes are kept in sync by subscribe_kernel_routes(), so
+	// only the routes computed by mospf are replaced
+	clear_dynamic_rtable();
 
 	set_rtable_with_path(src_index);
 
 	print_rtable();
 
-	pthread_mutex_unlock(&rtable_mutex);
+	rtable_update_end();
 
 	destroy_mospf_graph();
 
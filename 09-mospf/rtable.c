@@ -1,5 +1,6 @@
 #include "rtable.h"
 #include "ip.h"
+#include "rcu.h"
 
 #include "log.h"
 
@@ -8,12 +9,119 @@
 #include <string.h>
 
 struct list_head rtable;
-pthread_mutex_t rtable_mutex;
+
+rt_fib_t *rt_fib;			// the current snapshot
+static u32 rt_fib_version;
+
+// the writers of rtable are serialized by the mutex, and the snapshot is
+// published when the outermost update ends, if rtable was changed
+static pthread_mutex_t rtable_mutex;
+static int rtable_update_depth;
+static int rtable_changed;
+
+// build a snapshot of all the entries in rtable
+static rt_fib_t *new_rt_fib()
+{
+	int n = 0;
+	rt_entry_t *entry = NULL;
+	list_for_each_entry(entry, &rtable, list)
+		n += 1;
+
+	rt_fib_t *fib = malloc(sizeof(rt_fib_t));
+	rt_entry_t *entries = malloc(sizeof(rt_entry_t) * (n ? n : 1));
+	if (!fib || !entries) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	fib->entries = entries;
+	fib->nentries = 0;
+
+	list_for_each_entry(entry, &rtable, list) {
+		rt_entry_t *copy = &entries[fib->nentries++];
+		memcpy(copy, entry, sizeof(rt_entry_t));
+		init_list_head(&copy->list);
+		init_list_head(&copy->hash_list);
+	}
+
+	return fib;
+}
+
+static void free_rt_fib(rt_fib_t *fib)
+{
+	free(fib->entries);
+	free(fib);
+}
+
+// whether the snapshots forward the same, i.e. hold the same routes in the
+// same order
+static int rt_fib_equal(rt_fib_t *a, rt_fib_t *b)
+{
+	if (a->nentries != b->nentries)
+		return 0;
+
+	for (int i = 0; i < a->nentries; i++) {
+		rt_entry_t *x = &a->entries[i], *y = &b->entries[i];
+		if (x->dest != y->dest || x->mask != y->mask || x->gw != y->gw || \
+				x->flags != y->flags || x->metric != y->metric || \
+				x->tos != y->tos || x->iface != y->iface)
+			return 0;
+	}
+
+	return 1;
+}
+
+// swap in a new snapshot, and free the old one when no lookup is using it.
+// The snapshot is a copy of the whole of rtable, as it is scanned as a whole
+// by a lookup, so an update costs as much as a lookup of each route; but the
+// updates which leave the routes as they were, e.g. most of the recomputations
+// from the database, are dropped without waiting for the readers.
+static void publish_rt_fib()
+{
+	rt_fib_t *old = rt_fib;
+	if (old && !rtable_changed)
+		return;
+	rtable_changed = 0;
+
+	rt_fib_t *fib = new_rt_fib();
+	if (old && rt_fib_equal(old, fib)) {
+		free_rt_fib(fib);
+		return;
+	}
+
+	fib->version = ++rt_fib_version;
+	rcu_assign_pointer(rt_fib, fib);
+
+	if (old) {
+		synchronize_rcu();
+		free_rt_fib(old);
+	}
+}
 
 void init_rtable()
 {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&rtable_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
 	init_list_head(&rtable);
-	pthread_mutex_init(&rtable_mutex, NULL);
+	publish_rt_fib();
+}
+
+// the changes made to rtable between the outermost begin and end are
+// published at once, e.g. when the table is recomputed from the database
+void rtable_update_begin()
+{
+	pthread_mutex_lock(&rtable_mutex);
+	rtable_update_depth += 1;
+}
+
+void rtable_update_end()
+{
+	if (--rtable_update_depth == 0)
+		publish_rt_fib();
+	pthread_mutex_unlock(&rtable_mutex);
 }
 
 rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
@@ -22,6 +130,7 @@ rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
 	memset(entry, 0, sizeof(*entry));
 
 	init_list_head(&(entry->list));
+	init_list_head(&(entry->hash_list));
 	entry->dest = dest;
 	entry->mask = mask;
 	entry->gw = gw;
@@ -33,43 +142,75 @@ rt_entry_t *new_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
 
 void try_add_rt_entry(u32 dest, u32 mask, u32 gw, iface_info_t *iface)
 {
-	// Check for existing entry
+	rtable_update_begin();
+
+	// Check for existing entry; the kernel route of the same prefix is kept
+	// ahead of it, and loses in longest_prefix_match
 	rt_entry_t *entry = NULL;
 	list_for_each_entry(entry, &rtable, list) {
-		if (entry->dest == dest && entry->mask == mask) {
+		if (entry->dest == dest && entry->mask == mask && (entry->flags & RTF_DYNAMIC)) {
 			// Update existing entry
+			rtable_changed = 1;
 			entry->gw = gw;
 			entry->iface = iface;
 			strcpy(entry->if_name, iface->name);
+			rtable_update_end();
 			return;
 		}
 	}
 
 	// Add new entry
 	entry = new_rt_entry(dest, mask, gw, iface);
+	entry->flags = RTF_DYNAMIC;
 	list_add_tail(&entry->list, &rtable);
+	rtable_changed = 1;
+
+	rtable_update_end();
 }
 
 void add_rt_entry(rt_entry_t *entry)
 {
+	rtable_update_begin();
 	list_add_tail(&entry->list, &rtable);
+	rtable_changed = 1;
+	rtable_update_end();
 }
 
 void remove_rt_entry(rt_entry_t *entry)
 {
+	rtable_update_begin();
 	list_delete_entry(&entry->list);
+	list_delete_entry(&entry->hash_list);
 	free(entry);
+	rtable_changed = 1;
+	rtable_update_end();
 }
 
 void clear_rtable()
 {
+	rtable_update_begin();
 	struct list_head *head = &rtable, *tmp;
 	while (head->next != head) {
 		tmp = head->next;
 		list_delete_entry(tmp);
 		rt_entry_t *entry = list_entry(tmp, rt_entry_t, list);
+		list_delete_entry(&entry->hash_list);
 		free(entry);
+		rtable_changed = 1;
+	}
+	rtable_update_end();
+}
+
+// remove the routes computed by mospf, keeping the kernel routes
+void clear_dynamic_rtable()
+{
+	rtable_update_begin();
+	rt_entry_t *entry = NULL, *q;
+	list_for_each_entry_safe(entry, q, &rtable, list) {
+		if (entry->flags & RTF_DYNAMIC)
+			remove_rt_entry(entry);
 	}
+	rtable_update_end();
 }
 
 void print_rtable()